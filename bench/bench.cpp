@@ -0,0 +1,464 @@
+#include "../comparison.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#else
+#include <io.h>
+#endif
+
+using namespace std;
+
+// Generates two versions of a synthetic schema and times loading,
+// comparing and printing them, each on its own.
+//
+// Version a has 'messages' messages spread over 'files' files, each with
+// 'fields' fields: 'fan_out' of them refer to later messages, and one to
+// one of 'enums' enums. 'cycles' messages also refer back to an earlier
+// one, and every message has a chain of nested messages 'depth' deep.
+// Version b is a copy in which each message and enum is changed with
+// probability 'mutation'. The same seed gives the same schemas.
+
+struct Parameters
+{
+    int messages = 2000;
+    int fields = 10;
+    int enums = 100;
+    int enum_values = 10;
+    int depth = 2;
+    int fan_out = 2;
+    int cycles = 50;
+    double mutation = 0.05;
+    int files = 4;
+    unsigned seed = 1;
+    int repeat = 5;
+    unsigned jobs = 1;
+    string directory = "bench-schema";
+};
+
+struct Field
+{
+    string label;
+    string type;
+    string name;
+    int number;
+    string default_value;
+};
+
+struct Message
+{
+    string name;
+    vector<Field> fields;
+    vector<Message> nested;
+};
+
+struct Enum
+{
+    string name;
+    vector<pair<string, int>> values;
+};
+
+struct Schema
+{
+    vector<Enum> enums;
+    vector<Message> messages;
+};
+
+// The file that message 'index' is written to.
+static
+int file_of(int index, const Parameters & p)
+{
+    return int(int64_t(index) * p.files / p.messages);
+}
+
+static const char * const scalar_types[] = { "int32", "int64", "uint32", "string", "bytes", "bool", "double", "fixed32" };
+
+class Generator
+{
+public:
+    explicit Generator(const Parameters & p): p(p), random(p.seed) {}
+
+    Schema generate();
+    void mutate(Schema & schema);
+
+private:
+    int below(int n) { return n > 0 ? int(random() % unsigned(n)) : 0; }
+    bool chance(double probability) { return uniform_real_distribution<double>(0, 1)(random) < probability; }
+
+    string message_name(int index) const { return "bench.M" + to_string(index); }
+    Field scalar_field(int number);
+    Message nested_message(const string & name, int depth);
+    void mutate(Message & message);
+
+    const Parameters & p;
+    mt19937 random;
+};
+
+Field Generator::scalar_field(int number)
+{
+    Field field;
+    field.label = "optional";
+    field.type = scalar_types[below(int(size(scalar_types)))];
+    field.name = "f" + to_string(number);
+    field.number = number;
+    if (field.type == "int32" && chance(0.2))
+        field.default_value = to_string(below(100));
+    return field;
+}
+
+Message Generator::nested_message(const string & name, int depth)
+{
+    Message message;
+    message.name = name;
+    for (int i = 1; i <= 3; ++i)
+        message.fields.push_back(scalar_field(i));
+    if (depth > 1)
+        message.nested.push_back(nested_message("N" + to_string(depth - 1), depth - 1));
+    return message;
+}
+
+Schema Generator::generate()
+{
+    Schema schema;
+
+    for (int i = 0; i < p.enums; ++i)
+    {
+        Enum e;
+        e.name = "E" + to_string(i);
+        for (int j = 0; j < p.enum_values; ++j)
+            e.values.emplace_back(e.name + "_V" + to_string(j), j);
+        schema.enums.push_back(e);
+    }
+
+    for (int i = 0; i < p.messages; ++i)
+    {
+        Message message;
+        message.name = "M" + to_string(i);
+
+        for (int number = 1; number <= p.fields; ++number)
+        {
+            Field field = scalar_field(number);
+            int later = p.messages - i - 1;
+            if (number <= p.fan_out && later > 0)
+            {
+                // Only later messages, so that files import each other without a cycle.
+                field.type = message_name(i + 1 + below(min(later, 50)));
+                field.default_value.clear();
+                if (chance(0.3))
+                    field.label = "repeated";
+            }
+            else if (number == p.fan_out + 1 && p.enums > 0)
+            {
+                field.type = "bench.E" + to_string(below(p.enums));
+                field.default_value.clear();
+            }
+            message.fields.push_back(field);
+        }
+
+        if (p.depth > 0)
+        {
+            message.nested.push_back(nested_message("N" + to_string(p.depth), p.depth));
+            message.fields.push_back({ "optional", message.name + ".N" + to_string(p.depth), "nested", p.fields + 1, "" });
+        }
+
+        schema.messages.push_back(message);
+    }
+
+    // Back references within a file make recursive types.
+    for (int c = 0; c < p.cycles && p.messages > 1; ++c)
+    {
+        int to = below(p.messages - 1);
+        int from = to + 1 + below(min(p.messages - to - 1, 20));
+        if (file_of(from, p) != file_of(to, p))
+            continue;
+
+        auto & message = schema.messages[size_t(from)];
+        int number = int(message.fields.size()) + 1;
+        message.fields.push_back({ "optional", message_name(to), "back" + to_string(c), number, "" });
+    }
+
+    return schema;
+}
+
+void Generator::mutate(Message & message)
+{
+    if (message.fields.empty())
+        return;
+
+    auto & field = message.fields[size_t(below(int(message.fields.size())))];
+    switch (below(7))
+    {
+    case 0:
+        field.name += "_renamed";
+        break;
+    case 1:
+        field.number += 1000;
+        break;
+    case 2:
+        if (field.type.compare(0, 6, "bench.") != 0 && field.type.find('.') == string::npos)
+        {
+            field.type = field.type == "int64" ? "string" : "int64";
+            field.default_value.clear();
+        }
+        break;
+    case 3:
+        field.label = field.label == "repeated" ? "optional" : "repeated";
+        field.default_value.clear();
+        break;
+    case 4:
+        if (field.type == "int32")
+            field.default_value = to_string(below(100) + 100);
+        break;
+    case 5:
+        message.fields.erase(message.fields.begin() + (&field - message.fields.data()));
+        break;
+    default:
+        message.fields.push_back({ "optional", "bool", "added", 5000 + below(1000), "" });
+    }
+}
+
+void Generator::mutate(Schema & schema)
+{
+    for (auto & e : schema.enums)
+    {
+        if (!chance(p.mutation) || e.values.size() < 2)
+            continue;
+        if (chance(0.5))
+            e.values.pop_back();
+        else
+            e.values.emplace_back(e.name + "_ADDED", 1000);
+    }
+
+    for (auto & message : schema.messages)
+    {
+        if (chance(p.mutation))
+            mutate(message);
+    }
+}
+
+static
+void write_message(ostream & out, const Message & message, int indent)
+{
+    string space(size_t(indent) * 2, ' ');
+    out << space << "message " << message.name << " {\n";
+    for (auto & nested : message.nested)
+        write_message(out, nested, indent + 1);
+    for (auto & field : message.fields)
+    {
+        out << space << "  " << field.label << " " << field.type << " " << field.name << " = " << field.number;
+        if (!field.default_value.empty())
+            out << " [default = " << field.default_value << "]";
+        out << ";\n";
+    }
+    out << space << "}\n";
+}
+
+static
+string file_name(size_t index)
+{
+    return "bench" + to_string(index) + ".proto";
+}
+
+static
+void write_schema(const Schema & schema, const Parameters & p, const string & directory)
+{
+    filesystem::create_directories(directory);
+
+    ofstream enums(directory + "/enums.proto");
+    enums << "syntax = \"proto2\";\npackage bench;\n";
+    for (auto & e : schema.enums)
+    {
+        enums << "enum " << e.name << " {\n";
+        for (auto & value : e.values)
+            enums << "  " << value.first << " = " << value.second << ";\n";
+        enums << "}\n";
+    }
+
+    // Every file imports all later ones, which covers any forward reference.
+    vector<unique_ptr<ofstream>> files;
+    for (int i = 0; i < p.files; ++i)
+    {
+        files.emplace_back(new ofstream(directory + "/" + file_name(size_t(i))));
+        auto & out = *files.back();
+        out << "syntax = \"proto2\";\npackage bench;\nimport \"enums.proto\";\n";
+        for (int j = i + 1; j < p.files; ++j)
+            out << "import \"" << file_name(size_t(j)) << "\";\n";
+    }
+
+    for (size_t i = 0; i < schema.messages.size(); ++i)
+        write_message(*files[size_t(file_of(int(i), p))], schema.messages[i], 0);
+}
+
+// Runs 'phase' and returns how long it took, in milliseconds.
+static
+double time_ms(const function<void()> & phase)
+{
+    auto start = chrono::steady_clock::now();
+    phase();
+    return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+}
+
+// Points stdout at the null device until restore_stdout(), so that printing is timed without a terminal.
+static
+int silence_stdout()
+{
+    fflush(stdout);
+#ifndef _WIN32
+    int saved = dup(1);
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, 1);
+    close(null);
+#else
+    int saved = _dup(1);
+    int null = _open("NUL", _O_WRONLY);
+    _dup2(null, 1);
+    _close(null);
+#endif
+    return saved;
+}
+
+static
+void restore_stdout(int saved)
+{
+#ifndef _WIN32
+    dup2(saved, 1);
+    close(saved);
+#else
+    _dup2(saved, 1);
+    _close(saved);
+#endif
+}
+
+struct Timings
+{
+    vector<double> load;
+    vector<double> compare;
+    vector<double> print;
+};
+
+static
+void write_phase(ostream & out, const char * name, vector<double> times)
+{
+    sort(times.begin(), times.end());
+    out << "\"" << name << "\":{\"min_ms\":" << times.front()
+        << ",\"median_ms\":" << times[times.size() / 2] << "}";
+}
+
+int main(int argc, char * argv[])
+{
+    Parameters p;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        string arg = argv[i];
+        if (i + 1 >= argc)
+        {
+            cerr << "Expected a value after " << arg << endl;
+            return 1;
+        }
+        string value = argv[++i];
+
+        if (arg == "--messages")
+            p.messages = atoi(value.c_str());
+        else if (arg == "--fields")
+            p.fields = atoi(value.c_str());
+        else if (arg == "--enums")
+            p.enums = atoi(value.c_str());
+        else if (arg == "--enum-values")
+            p.enum_values = atoi(value.c_str());
+        else if (arg == "--depth")
+            p.depth = atoi(value.c_str());
+        else if (arg == "--fan-out")
+            p.fan_out = atoi(value.c_str());
+        else if (arg == "--cycles")
+            p.cycles = atoi(value.c_str());
+        else if (arg == "--mutation")
+            p.mutation = atof(value.c_str());
+        else if (arg == "--files")
+            p.files = atoi(value.c_str());
+        else if (arg == "--seed")
+            p.seed = unsigned(atoi(value.c_str()));
+        else if (arg == "--repeat")
+            p.repeat = atoi(value.c_str());
+        else if (arg == "--jobs")
+            p.jobs = unsigned(atoi(value.c_str()));
+        else if (arg == "--directory")
+            p.directory = value;
+        else
+        {
+            cerr << "Unknown option: " << arg << endl;
+            return 1;
+        }
+    }
+
+    if (p.messages < 1 || p.files < 1 || p.files > p.messages || p.repeat < 1 || p.jobs < 1 ||
+            p.fields < p.fan_out + 1)
+    {
+        cerr << "Invalid parameters." << endl;
+        return 1;
+    }
+
+    Generator generator(p);
+    Schema schema = generator.generate();
+    write_schema(schema, p, p.directory + "/a");
+    generator.mutate(schema);
+    write_schema(schema, p, p.directory + "/b");
+
+    Timings timings;
+
+    try
+    {
+        for (int run = 0; run < p.repeat; ++run)
+        {
+            unique_ptr<Source> source1, source2;
+            timings.load.push_back(time_ms([&]()
+            {
+                source1.reset(new Source(file_name(0), p.directory + "/a"));
+                source2.reset(new Source(file_name(0), p.directory + "/b"));
+            }));
+
+            Comparison::Options options;
+            options.jobs = p.jobs;
+            Comparison comparison(options);
+
+            timings.compare.push_back(time_ms([&]() { comparison.compare(*source1, *source2); }));
+
+            int saved = silence_stdout();
+            timings.print.push_back(time_ms([&]() { comparison.report.print(); }));
+            restore_stdout(saved);
+        }
+    }
+    catch (std::exception & e)
+    {
+        cerr << e.what() << endl;
+        return 1;
+    }
+
+    // One JSON object per run of the benchmark, to be compared between commits.
+    cout << "{\"parameters\":{\"messages\":" << p.messages << ",\"fields\":" << p.fields
+         << ",\"enums\":" << p.enums << ",\"enum_values\":" << p.enum_values << ",\"depth\":" << p.depth
+         << ",\"fan_out\":" << p.fan_out << ",\"cycles\":" << p.cycles << ",\"mutation\":" << p.mutation
+         << ",\"files\":" << p.files << ",\"seed\":" << p.seed << ",\"repeat\":" << p.repeat
+         << ",\"jobs\":" << p.jobs << "},\"phases\":{";
+    write_phase(cout, "load", timings.load);
+    cout << ",";
+    write_phase(cout, "compare", timings.compare);
+    cout << ",";
+    write_phase(cout, "print", timings.print);
+    cout << "}}" << endl;
+
+    return 0;
+}
@@ -0,0 +1,316 @@
+#include "census.h"
+#include "corpus.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <memory>
+#include <unordered_map>
+
+#if defined(__SSE2__) && (defined(__GNUC__) || defined(__clang__))
+#include <emmintrin.h>
+#define CENSUS_SSE2 1
+#endif
+
+using namespace std;
+
+using google::protobuf::Descriptor;
+using google::protobuf::FieldDescriptor;
+
+// Field numbers below this are counted in a vector rather than a map.
+static const uint32_t dense_numbers = 1024;
+// As deep as the protobuf parser goes by default.
+static const int max_depth = 100;
+
+// The length of the varint at 'pos', or 0 if it is longer than 10 bytes or runs past 'end'.
+static inline
+size_t varint_length(const uint8_t * pos, const uint8_t * end)
+{
+#ifdef CENSUS_SSE2
+    if (end - pos >= 16)
+    {
+        // One bit per byte, set where the varint goes on to the next byte.
+        __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pos));
+        unsigned stops = ~unsigned(_mm_movemask_epi8(bytes)) & 0xffff;
+        if (!stops)
+            return 0;
+        size_t length = size_t(__builtin_ctz(stops)) + 1;
+        return length <= 10 ? length : 0;
+    }
+#endif
+    for (size_t length = 1; length <= 10 && length <= size_t(end - pos); ++length)
+    {
+        if (!(pos[length - 1] & 0x80))
+            return length;
+    }
+    return 0;
+}
+
+// Reads a varint and moves 'pos' past it. Returns false if it is malformed.
+static inline
+bool read_varint(const uint8_t *& pos, const uint8_t * end, uint64_t & value)
+{
+    // Most tags and small lengths take one byte.
+    if (pos != end && !(*pos & 0x80))
+    {
+        value = *pos++;
+        return true;
+    }
+
+    size_t length = varint_length(pos, end);
+    if (!length)
+        return false;
+
+    value = 0;
+    for (size_t i = 0; i < length; ++i)
+        value |= uint64_t(pos[i] & 0x7f) << (7 * i);
+    pos += length;
+    return true;
+}
+
+class FieldCensus::Worker
+{
+public:
+    struct TypeCounts
+    {
+        explicit TypeCounts(const Descriptor * type);
+
+        const Descriptor * type;
+        vector<uint64_t> dense;
+        map<uint32_t, uint64_t> sparse;
+        // The counts of the types of message fields, looked up on first use.
+        unordered_map<uint32_t, TypeCounts*> children;
+    };
+
+    explicit Worker(const Descriptor * type): root(counts_of(type)) {}
+
+    void scan_message(const uint8_t * data, size_t size)
+    {
+        ++messages;
+        scan(data, data + size, root, 0, 0);
+    }
+
+    size_t messages = 0;
+    unordered_map<const Descriptor*, unique_ptr<TypeCounts>> types;
+
+private:
+    TypeCounts * counts_of(const Descriptor * type);
+    TypeCounts * child(TypeCounts & counts, uint32_t number);
+    // Walks fields up to 'end', or to the end of group 'group' if it is not 0.
+    // Counts them unless 'counts' is null. Returns null if the data is malformed.
+    const uint8_t * scan(const uint8_t * pos, const uint8_t * end, TypeCounts * counts, int depth, uint32_t group);
+
+    TypeCounts * root;
+};
+
+FieldCensus::Worker::TypeCounts::TypeCounts(const Descriptor * type):
+    type(type),
+    dense(dense_numbers)
+{
+    for (int i = 0; i < type->field_count(); ++i)
+    {
+        auto * field = type->field(i);
+        if (field->cpp_type() == FieldDescriptor::CPPTYPE_MESSAGE)
+            children[uint32_t(field->number())] = nullptr;
+    }
+}
+
+FieldCensus::Worker::TypeCounts * FieldCensus::Worker::counts_of(const Descriptor * type)
+{
+    auto & counts = types[type];
+    if (!counts)
+        counts.reset(new TypeCounts(type));
+    return counts.get();
+}
+
+FieldCensus::Worker::TypeCounts * FieldCensus::Worker::child(TypeCounts & counts, uint32_t number)
+{
+    auto it = counts.children.find(number);
+    if (it == counts.children.end())
+        return nullptr;
+    if (!it->second)
+        it->second = counts_of(counts.type->FindFieldByNumber(int(number))->message_type());
+    return it->second;
+}
+
+const uint8_t * FieldCensus::Worker::scan(const uint8_t * pos, const uint8_t * end, TypeCounts * counts,
+                                          int depth, uint32_t group)
+{
+    while (pos != end)
+    {
+        uint64_t tag;
+        if (!read_varint(pos, end, tag))
+            return nullptr;
+
+        uint32_t number = uint32_t(tag >> 3);
+        uint32_t wire_type = uint32_t(tag & 7);
+
+        if (wire_type == 4)
+            return number == group ? pos : nullptr;
+
+        if (counts)
+        {
+            if (number < dense_numbers)
+                ++counts->dense[number];
+            else
+                ++counts->sparse[number];
+        }
+
+        switch (wire_type)
+        {
+        case 0:
+        {
+            size_t length = varint_length(pos, end);
+            if (!length)
+                return nullptr;
+            pos += length;
+            break;
+        }
+        case 1:
+            if (end - pos < 8)
+                return nullptr;
+            pos += 8;
+            break;
+        case 2:
+        {
+            uint64_t length;
+            if (!read_varint(pos, end, length) || length > uint64_t(end - pos))
+                return nullptr;
+
+            // Only messages are looked into; strings, bytes and packed fields are skipped whole.
+            TypeCounts * nested = counts && depth < max_depth ? child(*counts, number) : nullptr;
+            if (nested && !scan(pos, pos + length, nested, depth + 1, 0))
+                return nullptr;
+            pos += length;
+            break;
+        }
+        case 3:
+        {
+            if (depth >= max_depth)
+                return nullptr;
+            TypeCounts * nested = counts ? child(*counts, number) : nullptr;
+            pos = scan(pos, end, nested, depth + 1, number);
+            if (!pos)
+                return nullptr;
+            break;
+        }
+        case 5:
+            if (end - pos < 4)
+                return nullptr;
+            pos += 4;
+            break;
+        default:
+            return nullptr;
+        }
+    }
+
+    // A group has to end before its message does.
+    return group ? nullptr : pos;
+}
+
+FieldCensus::FieldCensus(const Descriptor * type, const Options & options):
+    d_type(type),
+    d_options(options)
+{}
+
+void FieldCensus::run(const string & corpus_path)
+{
+    Corpus corpus(corpus_path, d_options.batch_size);
+
+    unsigned jobs = max(1u, min(d_options.jobs, unsigned(corpus.batches().size())));
+    vector<unique_ptr<Worker>> workers;
+    for (unsigned i = 0; i < jobs; ++i)
+        workers.emplace_back(new Worker(d_type));
+
+    corpus.run(jobs, [&workers](unsigned worker, const Corpus::Batch & batch)
+    {
+        const uint8_t * pos = batch.begin;
+        const uint8_t * data;
+        size_t size;
+        while (Corpus::next(pos, batch.end, data, size))
+            workers[worker]->scan_message(data, size);
+    });
+
+    for (auto & worker : workers)
+    {
+        d_messages += worker->messages;
+        for (auto & type : worker->types)
+        {
+            auto & counts = d_counts[type.first->full_name()];
+            auto & found = *type.second;
+            for (uint32_t number = 0; number < dense_numbers; ++number)
+            {
+                if (found.dense[number])
+                    counts[int(number)] += found.dense[number];
+            }
+            for (auto & sparse : found.sparse)
+                counts[int(sparse.first)] += sparse.second;
+        }
+    }
+}
+
+uint64_t FieldCensus::count(const string & message, int number) const
+{
+    auto type = d_counts.find(message);
+    if (type == d_counts.end())
+        return 0;
+    auto it = type->second.find(number);
+    return it == type->second.end() ? 0 : it->second;
+}
+
+void CensusSink::begin_section(Comparison::SectionType type, string_view a, string_view b)
+{
+    const Descriptor * message = nullptr;
+    if (type == Comparison::Message_Comparison)
+        message = pool->FindMessageTypeByName(string(a));
+    else if (type == Comparison::Message_Field_Comparison && !messages.empty())
+        message = messages.back();
+    messages.push_back(message);
+
+    out.begin_section(type, a, b);
+}
+
+void CensusSink::end_section()
+{
+    messages.pop_back();
+    out.end_section();
+}
+
+int CensusSink::number_of(const Descriptor * message, string_view id) const
+{
+    if (binary)
+        return atoi(string(id).c_str());
+    auto * field = message->FindFieldByName(string(id));
+    return field ? field->number() : 0;
+}
+
+void CensusSink::item(Comparison::ItemType type, string_view a, string_view b)
+{
+    const Descriptor * message = messages.empty() ? nullptr : messages.back();
+
+    int number = 0;
+    switch (type)
+    {
+    case Comparison::Message_Field_Removed:
+    case Comparison::Optional_Message_Field_Removed:
+    case Comparison::Optional_InputMessage_Field_Removed:
+    case Comparison::Optional_OutputMessage_Field_Removed:
+        if (message)
+            number = number_of(message, a);
+        break;
+    case Comparison::Message_Field_Id_Changed:
+        if (message)
+            number = atoi(string(a).c_str());
+        break;
+    default:
+        break;
+    }
+
+    if (!number)
+    {
+        out.item(type, a, b);
+        return;
+    }
+
+    string counted = string(a) + " (" + to_string(census.count(message->full_name(), number)) + " in corpus)";
+    out.item(type, counted, b);
+}
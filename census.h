@@ -0,0 +1,83 @@
+#pragma once
+
+#include "comparison.h"
+
+#include <google/protobuf/descriptor.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Counts how often each field number occurs in a corpus of serialized
+// messages of one type (see Corpus), by walking the wire format without
+// decoding any values. Length-delimited fields are skipped whole, unless
+// the schema says they hold a message, which is then walked the same way
+// and counted under its own type. Fields the schema doesn't know are
+// counted but never descended into.
+//
+// Varint lengths are found 16 bytes at a time with SSE2 where available,
+// and byte by byte otherwise.
+class FieldCensus
+{
+    using Descriptor = google::protobuf::Descriptor;
+
+public:
+    struct Options
+    {
+        Options() {}
+        unsigned jobs = 1;
+        // Bytes of messages per batch.
+        size_t batch_size = 4 * 1024 * 1024;
+    };
+
+    explicit FieldCensus(const Descriptor * type, const Options & options = Options{});
+
+    // Throws std::runtime_error if the corpus cannot be read or is malformed.
+    void run(const std::string & corpus_path);
+
+    size_t messages() const { return d_messages; }
+    // Occurrences of field 'number' in messages of type 'message' (a full name).
+    uint64_t count(const std::string & message, int number) const;
+    // Occurrences by field number, by full message name.
+    const std::map<std::string, std::map<int, uint64_t>> & counts() const { return d_counts; }
+
+private:
+    class Worker;
+
+    const Descriptor * d_type;
+    Options d_options;
+    size_t d_messages = 0;
+    std::map<std::string, std::map<int, uint64_t>> d_counts;
+};
+
+// Passes a report on, adding to each removed field and changed field
+// number how often the field of the first version occurs in a census, as
+// in "f (1234 in corpus)". 'pool' is the first version's, to look fields
+// up by name.
+class CensusSink : public Comparison::Sink
+{
+public:
+    CensusSink(Comparison::Sink & out, const FieldCensus & census,
+               const google::protobuf::DescriptorPool * pool, bool binary):
+        out(out), census(census), pool(pool), binary(binary) {}
+
+    void begin_section(Comparison::SectionType type, std::string_view a, std::string_view b) override;
+    void note(std::string_view a, std::string_view b) override { out.note(a, b); }
+    void item(Comparison::ItemType type, std::string_view a, std::string_view b) override;
+    void end_section() override;
+
+private:
+    // The number of the field 'id' (a name, or a number with Options::binary) of 'message', or 0.
+    int number_of(const google::protobuf::Descriptor * message, std::string_view id) const;
+
+    Comparison::Sink & out;
+    const FieldCensus & census;
+    const google::protobuf::DescriptorPool * pool;
+    bool binary;
+
+    // The first version's message of each open section, or null.
+    std::vector<const google::protobuf::Descriptor*> messages;
+};
@@ -1,126 +1,129 @@
 #include "comparison.h"
+#include "report_writer.h"
 
 #include <algorithm>
 #include <cctype>
 #include <iostream>
 #include <string>
+#include <vector>
 
 using namespace std;
 
-string Comparison::Item::message() const
+const char * Comparison::label(ItemType type)
 {
-    string msg;
-
     switch (type)
     {
     case Enum_Value_Name_Changed:
-        msg = "Value name changed";
-        break;
+        return "Value name changed";
     case Enum_Value_Id_Changed:
-        msg = "Value ID changed";
-        break;
+        return "Value ID changed";
     case Enum_Value_Added:
-        msg = "Value added";
-        break;
+        return "Value added";
     case Enum_Value_Removed:
-        msg = "Value removed";
-        break;
+        return "Value removed";
     case Message_Field_Name_Changed:
-        msg = "Name changed";
-        break;
+        return "Name changed";
     case Message_Field_Id_Changed:
-        msg = "ID changed";
-        break;
+        return "ID changed";
     case Message_Field_Label_Changed:
-        msg = "Label changed";
-        break;
+        return "Label changed";
     case Message_Field_Type_Changed:
-        msg = "Type changed";
-        break;
+        return "Type changed";
     case Message_Field_Default_Value_Changed:
-        msg = "Default value changed";
-        break;
+        return "Default value changed";
     case Message_Field_Added:
-        msg = "Field added";
-        break;
+        return "Field added";
     case Message_Field_Removed:
-        msg = "Field removed";
-        break;
+        return "Field removed";
     case File_Message_Added:
-        msg = "Message added";
-        break;
+        return "Message added";
     case File_Message_Removed:
-        msg = "Message removed";
-        break;
+        return "Message removed";
     case File_Enum_Added:
-        msg = "Enum added";
-        break;
+        return "Enum added";
     case File_Enum_Removed:
-        msg = "Enum removed";
-        break;
+        return "Enum removed";
     case Name_Missing:
-        msg = "Name missing";
-        break;
+        return "Name missing";
     case Optional_Message_Field_Added:
-        msg = "Optional_Field_added";
-        break;
+        return "Optional_Field_added";
     case Optional_Message_Field_Removed:
-        msg = "Optional_Field_removed";
-        break;
+        return "Optional_Field_removed";
     case File_Service_Added:
-        msg = "File Service Added";
-        break;
+        return "File Service Added";
     case File_Service_Removed:
-        msg = "File Service Removed";
-        break;
+        return "File Service Removed";
     case Optional_InputMessage_Field_Added:
-        msg = "Optional_InputField_added";
-        break;
+        return "Optional_InputField_added";
     case Optional_InputMessage_Field_Removed:
-        msg = "Optional_InputField_removed";
-        break;
+        return "Optional_InputField_removed";
     case Optional_OutputMessage_Field_Added:
-        msg = "Optional_OutputField_added";
-        break;
+        return "Optional_OutputField_added";
     case Optional_OutputMessage_Field_Removed:
-        msg = "Optional_OutputField_removed";
-        break;
+        return "Optional_OutputField_removed";
+    case File_Added:
+        return "File added";
+    case File_Removed:
+        return "File removed";
     default:
-        msg = "?";
-        return msg;
+        return nullptr;
     }
-
-    msg += ": " + a + " -> " + b;
-
-    return msg;
 }
 
-string Comparison::Section::message() const
+const char * Comparison::label(SectionType type)
 {
-    ostringstream msg;
-
     switch(type)
     {
     case Root_Section:
-        msg << "/";
-        break;
+        return "/";
     case Message_Comparison:
-        msg << "Comparing messages: " << a << " -> " << b;
-        break;
+        return "Comparing messages";
     case Message_Field_Comparison:
-        msg << "Comparing fields: " << a << " -> " << b;
-        break;
+        return "Comparing fields";
     case Enum_Comparison:
-        msg << "Comparing enums: " << a << " -> " << b;
-        break;
+        return "Comparing enums";
     case Enum_Value_Comparison:
-        msg << "Comparing enum values: " << a << " -> " << b;
-        break;
+        return "Comparing enum values";
+    case File_Comparison:
+        return "Comparing files";
+    case Version_Comparison:
+        return "Comparing versions";
     default:
-        msg << "?";
+        return nullptr;
     }
+}
+
+string Comparison::Item::message() const
+{
+    auto * text = label(type);
+    if (!text)
+        return "?";
+
+    string msg = text;
+    msg += ": ";
+    msg.append(a);
+    msg += " -> ";
+    msg.append(b);
+
+    return msg;
+}
+
+string Comparison::Section::message() const
+{
+    auto * text = label(type);
+    if (!text)
+        return "?";
+
+    string msg = text;
+    if (type == Root_Section)
+        return msg;
+
+    msg += ": ";
+    msg.append(a);
+    msg += " -> ";
+    msg.append(b);
 
-    return msg.str();
+    return msg;
 }
 
 static
@@ -158,33 +161,324 @@ void print_field(const FieldDescriptor * field)
     }
 }
 
-void Comparison::Section::print(int level)
+void Comparison::Report::begin_section(SectionType type, string_view a, string_view b)
+{
+    Index parent = open_sections.empty() ? None : open_sections.back();
+    open_sections.push_back(add_section(parent, type, a, b));
+}
+
+void Comparison::Report::note(string_view a, string_view b)
 {
-    cout << string(level*2, ' ') << message() << endl;
+    add_note(open_sections.back(), a, b);
+}
+
+void Comparison::Report::item(ItemType type, string_view a, string_view b)
+{
+    add_item(open_sections.back(), type, a, b);
+}
 
-    ++level;
+void Comparison::Report::end_section()
+{
+    open_sections.pop_back();
+}
 
-    string subprefix(level*2, ' ');
+Comparison::Index Comparison::Report::add_section(Index parent, SectionType type, string_view a, string_view b)
+{
+    parent = resolve(parent);
+    Index index = Index(section_records.size());
+    section_records.emplace_back(type, a, b, parent);
 
-    for (auto & note : notes)
+    if (parent != None)
     {
-        cout << subprefix << note << endl;
+        auto & p = section_records[parent];
+        if (p.last_subsection == None)
+            p.first_subsection = index;
+        else
+            section_records[p.last_subsection].next = index;
+        p.last_subsection = index;
     }
 
-    for (auto & item : items)
+    return index;
+}
+
+Comparison::Index Comparison::Report::insert_section(Index parent, Index previous, SectionType type,
+                                                     string_view a, string_view b)
+{
+    Index index = Index(section_records.size());
+    section_records.emplace_back(type, a, b, parent);
+
+    auto & p = section_records[parent];
+    auto & s = section_records[index];
+    if (previous == None)
     {
-        cout << subprefix << "* " << item.message() << endl;
+        s.next = p.first_subsection;
+        p.first_subsection = index;
     }
+    else
+    {
+        s.next = section_records[previous].next;
+        section_records[previous].next = index;
+    }
+    if (s.next == None)
+        p.last_subsection = index;
+
+    return index;
+}
+
+Comparison::Index Comparison::Report::defer_section(Index parent, SectionType type, string_view a, string_view b)
+{
+    deferred.push_back({ parent, type, a, b, None });
+    return Deferred_Bit | Index(deferred.size() - 1);
+}
+
+Comparison::Index Comparison::Report::end_deferred()
+{
+    Index index = deferred.back().index;
+    deferred.pop_back();
+    return index;
+}
+
+Comparison::Index Comparison::Report::resolve(Index index)
+{
+    if (!is_deferred(index))
+        return index;
+
+    // Adding the section resolves its parent in turn, so the whole pending path is added top down.
+    auto & pending = deferred[index & ~Deferred_Bit];
+    if (pending.index == None)
+        pending.index = add_section(pending.parent, pending.type, pending.a, pending.b);
+    return pending.index;
+}
+
+void Comparison::Report::add_item(Index section, ItemType type, string_view a, string_view b)
+{
+    section = resolve(section);
+    Index index = Index(item_records.size());
+    item_records.emplace_back(type, a, b);
+
+    auto & s = section_records[section];
+    if (s.last_item == None)
+        s.first_item = index;
+    else
+        item_records[s.last_item].next = index;
+    s.last_item = index;
+}
 
-    for (auto & subsection : subsections)
+void Comparison::Report::insert_item(Index section, ItemType type, string_view a, string_view b, ItemType before)
+{
+    section = resolve(section);
+    auto & s = section_records[section];
+
+    Index previous = None;
+    Index position = s.first_item;
+    while (position != None && item_records[position].type != before)
     {
-        subsection.print(level);
+        previous = position;
+        position = item_records[position].next;
     }
+
+    if (position == None)
+    {
+        add_item(section, type, a, b);
+        return;
+    }
+
+    Index index = Index(item_records.size());
+    item_records.emplace_back(type, a, b);
+    item_records[index].next = position;
+
+    if (previous == None)
+        s.first_item = index;
+    else
+        item_records[previous].next = index;
+}
+
+void Comparison::Report::add_note(Index section, string_view a, string_view b)
+{
+    section = resolve(section);
+    Index index = Index(note_records.size());
+    note_records.emplace_back(a, b);
+
+    auto & s = section_records[section];
+    if (s.last_note == None)
+        s.first_note = index;
+    else
+        note_records[s.last_note].next = index;
+    s.last_note = index;
+}
+
+Comparison::Index Comparison::Report::append(Report & fragment, Index parent)
+{
+    Index section_offset = Index(section_records.size());
+    Index item_offset = Index(item_records.size());
+    Index note_offset = Index(note_records.size());
+
+    auto rebase = [](Index & index, Index offset)
+    {
+        if (index != None)
+            index += offset;
+    };
+
+    section_records.reserve(section_records.size() + fragment.section_records.size());
+    for (auto & section : fragment.section_records)
+    {
+        section_records.push_back(section);
+        auto & s = section_records.back();
+        rebase(s.parent, section_offset);
+        rebase(s.next, section_offset);
+        rebase(s.first_subsection, section_offset);
+        rebase(s.last_subsection, section_offset);
+        rebase(s.first_item, item_offset);
+        rebase(s.last_item, item_offset);
+        rebase(s.first_note, note_offset);
+        rebase(s.last_note, note_offset);
+    }
+
+    item_records.reserve(item_records.size() + fragment.item_records.size());
+    for (auto & item : fragment.item_records)
+    {
+        item_records.push_back(item);
+        rebase(item_records.back().next, item_offset);
+    }
+
+    note_records.reserve(note_records.size() + fragment.note_records.size());
+    for (auto & note : fragment.note_records)
+    {
+        note_records.push_back(note);
+        rebase(note_records.back().next, note_offset);
+    }
+
+    // The text blocks move as they are, so views into them stay valid.
+    for (auto & block : fragment.text_blocks)
+        text_blocks.push_back(std::move(block));
+
+    fragment.clear();
+
+    // Link the fragment's first section as the last subsection of 'parent'.
+    Index index = section_offset;
+    section_records[index].parent = parent;
+    auto & p = section_records[parent];
+    if (p.last_subsection == None)
+        p.first_subsection = index;
+    else
+        section_records[p.last_subsection].next = index;
+    p.last_subsection = index;
+
+    return index;
+}
+
+string_view Comparison::Report::store(string_view text)
+{
+    if (text.size() > text_left)
+    {
+        // Blocks grow with the report, so small fragments stay small; the shift
+        // is capped at the largest size (256 << 8), as it would overflow later.
+        size_t growth = std::min<size_t>(size_t(256) << std::min<size_t>(text_blocks.size(), 8), 64 * 1024);
+        size_t size = std::max<size_t>(text.size(), growth);
+        text_blocks.emplace_back(new char[size]);
+        text_end = text_blocks.back().get();
+        text_left = size;
+    }
+
+    char * start = text_end;
+    copy(text.begin(), text.end(), start);
+    text_end += text.size();
+    text_left -= text.size();
+    return string_view(start, text.size());
+}
+
+bool Comparison::Report::has_items(Index section) const
+{
+    auto & s = section_records[section];
+    if (s.first_item != None)
+        return true;
+
+    for (Index child = s.first_subsection; child != None; child = section_records[child].next)
+    {
+        if (has_items(child))
+            return true;
+    }
+    return false;
+}
+
+void Comparison::Report::emit(Index section, Sink & sink) const
+{
+    send(section, sink, true);
+}
+
+void Comparison::Report::send(Index section, Sink & sink, bool skip_empty) const
+{
+    if (skip_empty && !has_items(section))
+        return;
+
+    auto & s = section_records[section];
+    sink.begin_section(s.type, s.a, s.b);
+
+    for (auto & note : notes(section))
+        sink.note(note.a, note.b);
+
+    for (auto & item : items(section))
+        sink.item(item.type, item.a, item.b);
+
+    for (Index child = s.first_subsection; child != None; child = section_records[child].next)
+        send(child, sink, skip_empty);
+
+    sink.end_section();
+}
+
+void Comparison::Report::print() const
+{
+    if (section_records.empty())
+        return;
+
+    OutputBuffer out;
+    TextWriter writer(out);
+    send(0, writer, false);
+    out.flush();
+}
+
+void Comparison::Report::clear(bool keep_text)
+{
+    // Releases everything at once; nothing in the report owns memory on its own.
+    vector<Section>().swap(section_records);
+    vector<Item>().swap(item_records);
+    vector<Note>().swap(note_records);
+    open_sections.clear();
+    deferred.clear();
+
+    if (keep_text)
+        return;
+
+    text_blocks.clear();
+    text_left = 0;
+    text_end = nullptr;
 }
 
 Comparison::Comparison(const Options & options):
     options(options)
-{}
+{
+    working.add_section(None, Root_Section, "", "");
+}
+
+void Comparison::use_fingerprints(Source & source1, Source & source2)
+{
+    fingerprints1 = &source1.fingerprints();
+    fingerprints2 = &source2.fingerprints();
+}
+
+bool Comparison::identical(const Descriptor * desc1, const Descriptor * desc2) const
+{
+    if (desc1 == desc2)
+        return true;
+    return fingerprints1 && fingerprints1->of(desc1) == fingerprints2->of(desc2);
+}
+
+bool Comparison::identical(const EnumDescriptor * enum1, const EnumDescriptor * enum2) const
+{
+    if (enum1 == enum2)
+        return true;
+    return fingerprints1 && fingerprints1->of(enum1) == fingerprints2->of(enum2);
+}
 
 bool Comparison::compare_default_value(const FieldDescriptor * field1, const FieldDescriptor * field2)
 {
@@ -222,14 +516,224 @@ bool Comparison::compare_default_value(const FieldDescriptor * field1, const Fie
     }
 }
 
-Comparison::Section * Comparison::compare(const EnumDescriptor * enum1, const EnumDescriptor * enum2)
+WorkStealingPool & Comparison::workers()
+{
+    if (!pool)
+        pool.reset(new WorkStealingPool(options.jobs));
+    return *pool;
+}
+
+bool Comparison::is_breaking(ItemType type) const
+{
+    switch (type)
+    {
+    // Additions, which old readers ignore.
+    case Enum_Value_Added:
+    case Message_Field_Added:
+    case File_Message_Added:
+    case File_Enum_Added:
+    case File_Service_Added:
+    case File_Added:
+    case Optional_Message_Field_Added:
+    case Optional_InputMessage_Field_Added:
+    case Optional_OutputMessage_Field_Added:
+    // An optional field may be missing from a request or response anyway.
+    case Optional_InputMessage_Field_Removed:
+    case Optional_OutputMessage_Field_Removed:
+        return false;
+
+    // The binary encoding only knows numbers, JSON only knows names.
+    case Enum_Value_Name_Changed:
+    case Message_Field_Name_Changed:
+        return !options.binary;
+    case Enum_Value_Id_Changed:
+    case Message_Field_Id_Changed:
+        return options.binary;
+
+    // Anything else, including a field's own type change. The type change
+    // placed for a field whose message or enum pair changed isn't added
+    // through here: that field breaks only through a breaking change of the
+    // pair, found in its own comparison.
+    default:
+        return true;
+    }
+}
+
+const Comparison::Item * Comparison::first_breaking() const
+{
+    return breaking_item.get();
+}
+
+void Comparison::add_item(Report & out, Index section, ItemType type, string_view a, string_view b)
+{
+    if (!options.fail_fast)
+    {
+        out.add_item(section, type, a, b);
+        count(Stats::Items_Created);
+        return;
+    }
+
+    if (!is_breaking(type))
+        return;
+
+    lock_guard<mutex> lock(entries_mutex);
+    if (!breaking_item)
+        breaking_item.reset(new Item(type, report.store(a), report.store(b)));
+    stop = true;
+}
+
+Comparison::Report & Comparison::output(Entry & entry)
+{
+    if (!options.fail_fast)
+        return entry.fragment;
+
+    // Field sections of a fail-fast check, dropped as soon as a pair is done.
+    static thread_local Report scratch;
+    scratch.clear();
+    return scratch;
+}
+
+string_view Comparison::id_of(Report & out, const FieldDescriptor * field) const
+{
+    return options.binary ? out.store(to_string(field->number())) : string_view(field->name());
+}
+
+string_view Comparison::id_of(Report & out, const google::protobuf::EnumValueDescriptor * value) const
+{
+    return options.binary ? out.store(to_string(value->number())) : string_view(value->name());
+}
+
+Comparison::Entry * Comparison::new_entry()
+{
+    lock_guard<mutex> lock(entries_mutex);
+    entries.emplace_back();
+    return &entries.back();
+}
+
+Comparison::Entry * Comparison::claim(const EnumDescriptor * enum1, const EnumDescriptor * enum2)
+{
+    auto memo = compared.find_or_insert(enum1, enum2, [&]()
+    {
+        auto * entry = new_entry();
+        entry->enum1 = enum1;
+        entry->enum2 = enum2;
+        return entry;
+    });
+
+    auto * entry = memo.first;
+    count(memo.second ? Stats::Memo_Misses : Stats::Memo_Hits);
+    if (!memo.second && options.trace)
+        options.trace->instant("compare enum", enum1->full_name(), enum2->full_name(), true);
+    if (memo.second && !stopped())
+        workers().push([this, entry]() { compare_enums(*entry); });
+
+    return entry;
+}
+
+Comparison::Entry * Comparison::claim(const Descriptor * desc1, MessageType desc1type,
+                                      const Descriptor * desc2, MessageType desc2type)
+{
+    auto memo = compared.find_or_insert(desc1, desc2, [&]()
+    {
+        auto * entry = new_entry();
+        entry->desc1 = desc1;
+        entry->desc2 = desc2;
+        entry->desc1type = desc1type;
+        entry->desc2type = desc2type;
+        return entry;
+    });
+
+    auto * entry = memo.first;
+    count(memo.second ? Stats::Memo_Misses : Stats::Memo_Hits);
+    if (!memo.second && options.trace)
+        options.trace->instant("compare message", desc1->full_name(), desc2->full_name(), true);
+    if (memo.second && !stopped())
+        workers().push([this, entry]() { compare_messages(*entry); });
+
+    return entry;
+}
+
+void Comparison::run()
 {
-    string key = enum1->full_name() + ":" + enum2->full_name();
-    if (compared.count(key))
-        return compared.at(key);
+    workers().wait();
+}
+
+// Places the compared pairs and passes the result on to the sink, a
+// top-level pair with the pairs it pulls in at a time.
+void Comparison::finish(const vector<Entry*> & top_level)
+{
+    run();
+
+    if (options.fail_fast)
+        return;
+
+    count_referrers();
 
-    auto & section = root.add_subsection(Enum_Comparison, enum1->full_name(), enum2->full_name());
-    compared.emplace(key, &section);
+    auto & out = sink();
+    out.begin_section(Root_Section, "", "");
+    for (auto & item : working.items(0))
+        out.item(item.type, item.a, item.b);
+
+    for (auto * entry : top_level)
+    {
+        if (entry->state == Entry::Pending)
+            place(*entry, 0);
+        flush();
+    }
+
+    out.end_section();
+}
+
+void Comparison::count_referrers()
+{
+    for (auto & entry : entries)
+    {
+        for (auto & reference : entry.references)
+            ++reference.target->referrers;
+    }
+}
+
+void Comparison::flush()
+{
+    while (!unflushed.empty())
+    {
+        auto * entry = unflushed.front();
+        if (entry->state != Entry::Placed || entry->referrers)
+            break;
+        working.emit(entry->section, sink());
+        unflushed.pop_front();
+    }
+
+    if (!unflushed.empty())
+        return;
+
+    // Nothing placed is waiting any more: start over, keeping only the text the sink may still refer to.
+    working.clear(true);
+    working.add_section(None, Root_Section, "", "");
+}
+
+void Comparison::compare_enums(Entry & entry)
+{
+    auto * enum1 = entry.enum1;
+    auto * enum2 = entry.enum2;
+
+    Trace::Span span(options.trace, "compare enum", enum1->full_name(), enum2->full_name());
+    span.memo(false);
+
+    if (stopped())
+        return;
+    if (identical(enum1, enum2))
+    {
+        count(Stats::Identical_Pairs);
+        span.identical();
+        return;
+    }
+    count(Stats::Enums_Compared);
+
+    auto & out = output(entry);
+    // The pair's section, added with the first change found.
+    const Index section = out.defer_section(None, Enum_Comparison, enum1->full_name(), enum2->full_name());
+    uint64_t value_pairs = 0;
 
     for (int i = 0; i < enum1->value_count(); ++i)
     {
@@ -240,23 +744,26 @@ Comparison::Section * Comparison::compare(const EnumDescriptor * enum1, const En
 
         if (value2)
         {
-            auto & subsection = section.add_subsection(Enum_Value_Comparison, value1->name(), value2->name());
+            ++value_pairs;
+            auto subsection = out.defer_section(section, Enum_Value_Comparison, value1->name(), value2->name());
 
             if (value1->number() != value2->number())
             {
-                subsection.add_item(Enum_Value_Id_Changed,
-                                    to_string(value1->number()), to_string(value2->number()));
+                add_item(out, subsection, Enum_Value_Id_Changed,
+                         out.store(to_string(value1->number())), out.store(to_string(value2->number())));
             }
             if (value1->name() != value2->name())
             {
-                subsection.add_item(Enum_Value_Name_Changed,
-                                    value1->name(), value2->name());
+                add_item(out, subsection, Enum_Value_Name_Changed,
+                         value1->name(), value2->name());
             }
+
+            if (out.end_deferred() != None)
+                entry.local_changes = true;
         }
         else
         {
-            string value1_id = options.binary ? to_string(value1->number()) : value1->name();
-            section.add_item(Enum_Value_Removed, value1_id, "");
+            add_item(out, section, Enum_Value_Removed, id_of(out, value1), "");
         }
     }
 
@@ -269,88 +776,91 @@ Comparison::Section * Comparison::compare(const EnumDescriptor * enum1, const En
 
         if (!value1)
         {
-            string value2_id = options.binary ? to_string(value2->number()) : value2->name();
-            section.add_item(Enum_Value_Added, "", value2_id);
+            add_item(out, section, Enum_Value_Added, "", id_of(out, value2));
         }
     }
 
-    return &section;
+    if (out.end_deferred() != None)
+        entry.local_changes = true;
+    count(Stats::Enum_Value_Pairs, value_pairs);
 }
 
-Comparison::Section Comparison::compare(const FieldDescriptor * field1, const FieldDescriptor * field2)
+void Comparison::compare(const FieldDescriptor * field1, const FieldDescriptor * field2, Report & out, Index section,
+                         Entry & entry, bool changed_before)
 {
-    Section section(Message_Field_Comparison, field1->name(), field2->name());
-
     if (field1->name() != field2->name())
     {
-        section.add_item(Message_Field_Name_Changed, field1->name(), field2->name());
+        add_item(out, section, Message_Field_Name_Changed, field1->name(), field2->name());
     }
 
     if (field1->number() != field2->number())
     {
-        section.add_item(Message_Field_Id_Changed, to_string(field1->number()), to_string(field2->number()));
+        add_item(out, section, Message_Field_Id_Changed,
+                 out.store(to_string(field1->number())), out.store(to_string(field2->number())));
     }
 
     if (field1->label() != field2->label())
     {
-        section.add_item(Message_Field_Label_Changed, "", "");
+        add_item(out, section, Message_Field_Label_Changed, "", "");
     }
 
     if (field1->type() != field2->type())
     {
-        section.add_item(Message_Field_Type_Changed, field1->type_name(), field2->type_name());
+        add_item(out, section, Message_Field_Type_Changed, field1->type_name(), field2->type_name());
     }
     else if (field1->type() == FieldDescriptor::TYPE_ENUM)
     {
-        auto * enum1 = field1->enum_type();
-        auto * enum2 = field2->enum_type();
-
-        auto * type_comparison = compare(enum1, enum2);
-        type_comparison->notes.push_back("Required by " + field1->full_name() + " -> " + field2->full_name());
-
-        type_comparison->trim();
-        if (!type_comparison->is_empty())
-        {
-            section.add_item(Message_Field_Type_Changed, enum1->full_name(), enum2->full_name());
-        }
+        auto * target = claim(field1->enum_type(), field2->enum_type());
+        if (!options.fail_fast)
+            entry.references.push_back({ section, target, field1, field2, changed_before });
     }
     else if (field1->type() == FieldDescriptor::TYPE_MESSAGE)
     {
         auto * msg1 = field1->message_type();
         auto * msg2 = field2->message_type();
 
-        const MessageType msg1type = getMessageType(msg1->full_name());
-        const MessageType msg2type = getMessageType(msg2->full_name());
-        auto * type_comparison = compare(msg1, msg1type, msg2, msg2type);
-        type_comparison->notes.push_back("Required by " + field1->full_name() + " -> " + field2->full_name());
-
-        type_comparison->trim();
-        if (!type_comparison->is_empty())
-        {
-            section.add_item(Message_Field_Type_Changed, msg1->full_name(), msg2->full_name());
-        }
+        const MessageType msg1type = getMessageType(msg1);
+        const MessageType msg2type = getMessageType(msg2);
+        auto * target = claim(msg1, msg1type, msg2, msg2type);
+        if (!options.fail_fast)
+            entry.references.push_back({ section, target, field1, field2, changed_before });
     }
 
     if (field1->cpp_type() == field2->cpp_type())
     {
         if (!compare_default_value(field1, field2))
         {
-            section.add_item(Message_Field_Default_Value_Changed, "", "");
+            add_item(out, section, Message_Field_Default_Value_Changed, "", "");
         }
     }
-
-    return section;
 }
 
-Comparison::Section * Comparison::compare(const Descriptor * desc1, Comparison::MessageType desc1type, const Descriptor * desc2, Comparison::MessageType desc2type)
+void Comparison::compare_messages(Entry & entry)
 {
-    string key = desc1->full_name() + ":" + desc2->full_name();
-    if (compared.count(key))
-        return compared.at(key);
+    auto * desc1 = entry.desc1;
+    auto * desc2 = entry.desc2;
+    auto desc1type = entry.desc1type;
 
-    auto & section = root.add_subsection(Message_Comparison, desc1->full_name(), desc2->full_name());
-    compared.emplace(key, &section);
+    Trace::Span span(options.trace, "compare message", desc1->full_name(), desc2->full_name());
+    span.memo(false);
 
+    if (stopped())
+        return;
+    // Nothing below a pair of structurally identical types can differ.
+    if (identical(desc1, desc2))
+    {
+        count(Stats::Identical_Pairs);
+        span.identical();
+        return;
+    }
+    count(Stats::Messages_Compared);
+
+    auto & out = output(entry);
+    // The pair's section, added with the first change found.
+    const Index section = out.defer_section(None, Message_Comparison, desc1->full_name(), desc2->full_name());
+
+    bool changed = false;
+    uint64_t field_pairs = 0;
 
     for (int i = 0; i < desc1->field_count(); ++i)
     {
@@ -361,30 +871,46 @@ Comparison::Section * Comparison::compare(const Descriptor * desc1, Comparison::
 
         if (field2)
         {
-            section.subsections.push_back(compare(field1, field2));
+            ++field_pairs;
+            auto subsection = out.defer_section(section, Message_Field_Comparison, field1->name(), field2->name());
+            size_t references = entry.references.size();
+            compare(field1, field2, out, subsection, entry, changed);
+
+            Index field_section = out.end_deferred();
+            if (field_section != None)
+                changed = true;
+            if (entry.references.size() > references)
+            {
+                // place() adds the section if the field's type turns out to be changed.
+                auto & reference = entry.references.back();
+                reference.field_section = field_section;
+                // The pair's own section is the first in the fragment, if it was added.
+                if (field_section == None && !out.empty())
+                    reference.previous_section = out.section(0).last_subsection;
+            }
         }
         else
         {
-            string field1_id = options.binary ? to_string(field1->number()) : field1->name();
+            auto field1_id = id_of(out, field1);
             if(field1->has_optional_keyword())
             {
 	            switch (desc1type)
 	            {
                 case Comparison::InputMessage:
-                    section.add_item(Optional_InputMessage_Field_Removed, field1_id, "");
+                    add_item(out, section, Optional_InputMessage_Field_Removed, field1_id, "");
                     break;
                 case Comparison::OutputMessage:
-                    section.add_item(Optional_OutputMessage_Field_Removed, field1_id, "");
+                    add_item(out, section, Optional_OutputMessage_Field_Removed, field1_id, "");
                     break;
                 case Comparison::Undefined:
-                    section.add_item(Optional_Message_Field_Removed, field1_id, "");
+                    add_item(out, section, Optional_Message_Field_Removed, field1_id, "");
                     break;
 	            }
             }else
             {
-                section.add_item(Message_Field_Removed, field1_id, "");
+                add_item(out, section, Message_Field_Removed, field1_id, "");
             }
-            
+            changed = true;
         }
     }
 
@@ -397,30 +923,108 @@ Comparison::Section * Comparison::compare(const Descriptor * desc1, Comparison::
 
         if (!field1)
         {
-            string field2_id = options.binary ? to_string(field2->number()) : field2->name();
+            auto field2_id = id_of(out, field2);
             if(field2->has_optional_keyword())
             {
                 switch (desc1type)
                 {
                 case Comparison::InputMessage:
-                    section.add_item(Optional_InputMessage_Field_Added, field2_id, "");
+                    add_item(out, section, Optional_InputMessage_Field_Added, field2_id, "");
                     break;
                 case Comparison::OutputMessage:
-                    section.add_item(Optional_OutputMessage_Field_Added, field2_id, "");
+                    add_item(out, section, Optional_OutputMessage_Field_Added, field2_id, "");
                     break;
                 case Comparison::Undefined:
-                    section.add_item(Optional_Message_Field_Added, field2_id, "");
+                    add_item(out, section, Optional_Message_Field_Added, field2_id, "");
                     break;
                 }
             }
             else
             {
-                section.add_item(Message_Field_Added, "", field2_id);
+                add_item(out, section, Message_Field_Added, "", field2_id);
             }
+            changed = true;
         }
     }
 
-    return &section;
+    // place() needs the section of a pair that refers to others even without changes of its own,
+    // as the field types may turn out to be changed.
+    if (out.end_deferred() == None && !entry.references.empty())
+        out.add_section(None, Message_Comparison, desc1->full_name(), desc2->full_name());
+
+    entry.local_changes = changed;
+    count(Stats::Field_Pairs, field_pairs);
+}
+
+// Links a compared pair, and the pairs it refers to, under root. This walks
+// the pairs depth first in field order, so the report comes out in the
+// same order however the pairs were scheduled. A field's type counts as
+// changed if the referenced pair has changes; for a pair that is still
+// being placed further up (a recursive type), only the changes seen
+// before the field that leads back to it count.
+void Comparison::place(Entry & entry, Index parent)
+{
+    entry.state = Entry::Placing;
+    // A pair without changes or references has no section, and nothing to place.
+    if (entry.fragment.empty())
+    {
+        entry.state = Entry::Placed;
+        return;
+    }
+
+    count(Stats::Sections_Created, entry.fragment.section_count());
+    // Sections of the fragment keep their order, so fragment indices become entry.section + index.
+    entry.section = working.append(entry.fragment, parent);
+    unflushed.push_back(&entry);
+
+    bool references_changed = false;
+    // The last field section placed here for a reference, and the section it was placed after.
+    Index added_section = None;
+    Index added_after = None;
+
+    for (auto & reference : entry.references)
+    {
+        entry.changed_so_far = reference.changed_before || references_changed;
+
+        auto & target = *reference.target;
+        if (target.state == Entry::Pending)
+            place(target, parent);
+
+        bool target_changed = target.state == Entry::Placing ? target.changed_so_far : target.changed;
+        if (target_changed)
+        {
+            Index field_section;
+            if (reference.field_section != None)
+            {
+                field_section = entry.section + reference.field_section;
+            }
+            else
+            {
+                // Add the field's section where it would have been, after any added for earlier fields.
+                Index previous = reference.previous_section == None ? None : entry.section + reference.previous_section;
+                Index after = added_section != None && added_after == previous ? added_section : previous;
+                field_section = working.insert_section(entry.section, after, Message_Field_Comparison,
+                                                       reference.field1->name(), reference.field2->name());
+                added_section = field_section;
+                added_after = previous;
+                count(Stats::Sections_Created);
+            }
+
+            // Keep the usual order of items: the type change goes before a default value change.
+            auto & target_section = working.section(target.section);
+            working.insert_item(field_section, Message_Field_Type_Changed,
+                                target_section.a, target_section.b, Message_Field_Default_Value_Changed);
+            count(Stats::Items_Created);
+            references_changed = true;
+        }
+
+        if (target.section != None)
+            working.add_note(target.section, reference.field1->full_name(), reference.field2->full_name());
+        --target.referrers;
+    }
+
+    entry.changed = entry.local_changes || references_changed;
+    entry.state = Entry::Placed;
 }
 
 void Comparison::compare(Source & source1, Source & source2)
@@ -428,22 +1032,29 @@ void Comparison::compare(Source & source1, Source & source2)
     auto * file1 = source1.file_descriptor();
     auto * file2 = source2.file_descriptor();
 
-    
+    use_fingerprints(source1, source2);
+    index_roles(file1);
+    index_roles(file2);
+
+    // Message and enum pairs in file order; each is compared as its own task.
+    vector<Entry*> top_level;
+
+    collect(file1, file2, 0, top_level);
+    finish(top_level);
+}
+
+// Adds the services, messages and enums added to or removed from a file to
+// 'section', and claims the pairs of top-level messages and enums.
+void Comparison::collect(const FileDescriptor * file1, const FileDescriptor * file2, Index section,
+                         vector<Entry*> & top_level)
+{
     for (int i = 0; i < file1->service_count(); ++i)
     {
         auto* service1 = file1->service(i);
         auto* service2 = file2->FindServiceByName(service1->name());
         if (! service2)
         {
-            root.add_item(File_Service_Removed, service1->full_name(), "");
-        }
-
-        //Die Input und Output messages der Methoden werden gesucht
-        for (int x = 0; x < service1->method_count(); ++x)
-        {
-            auto* method1 = service1->method(x);
-            this->inputMessages.push_back(method1->input_type()->full_name());
-            this->outputMessages.push_back(method1->output_type()->full_name());
+            add_item(working, section, File_Service_Removed, service1->full_name(), "");
         }
     }
 
@@ -453,20 +1064,8 @@ void Comparison::compare(Source & source1, Source & source2)
         auto* service1 = file1->FindServiceByName(service2->name());
         if (!service1)
         {
-            root.add_item(File_Service_Added, service2->full_name(), "");
-        }
-
-        //Die Input und Output messages der Methoden werden gesucht
-        for (int x = 0; x < service2->method_count(); ++x)
-        {
-            auto* method2 = service2->method(x);
-            this->inputMessages.push_back(method2->input_type()->full_name());
-            this->outputMessages.push_back(method2->output_type()->full_name());
+            add_item(working, section, File_Service_Added, service2->full_name(), "");
         }
-
-        this->inputMessages.unique();
-        this->outputMessages.unique();
-        
     }
 
     for (int i = 0; i < file2->message_type_count(); ++i)
@@ -475,7 +1074,7 @@ void Comparison::compare(Source & source1, Source & source2)
         auto* msg1 = file1->FindMessageTypeByName(msg2->name());
         if (!msg1)
         {
-            root.add_item(File_Message_Added, "", msg2->full_name());
+            add_item(working, section, File_Message_Added, "", msg2->full_name());
         }
     }
 
@@ -486,14 +1085,14 @@ void Comparison::compare(Source & source1, Source & source2)
         if (msg2)
         {
             //Get Message type of msg1 and msg2
-            const MessageType msg1type = getMessageType(msg1->full_name());
-            const MessageType msg2type = getMessageType(msg2->full_name());
+            const MessageType msg1type = getMessageType(msg1);
+            const MessageType msg2type = getMessageType(msg2);
 
-            compare(msg1, msg1type, msg2, msg2type);
+            top_level.push_back(claim(msg1, msg1type, msg2, msg2type));
         }
         else
         {
-            root.add_item(File_Message_Removed, msg1->full_name(), "");
+            add_item(working, section, File_Message_Removed, msg1->full_name(), "");
         }
     }
 
@@ -503,7 +1102,7 @@ void Comparison::compare(Source & source1, Source & source2)
         auto * msg1 = file1->FindMessageTypeByName(msg2->name());
         if (!msg1)
         {
-            root.add_item(File_Message_Added, "", msg2->full_name());
+            add_item(working, section, File_Message_Added, "", msg2->full_name());
         }
     }
 
@@ -513,11 +1112,11 @@ void Comparison::compare(Source & source1, Source & source2)
         auto * enum2 = file2->FindEnumTypeByName(enum1->name());
         if (enum2)
         {
-            compare(enum1, enum2);
+            top_level.push_back(claim(enum1, enum2));
         }
         else
         {
-            root.add_item(File_Enum_Removed, enum1->full_name(), "");
+            add_item(working, section, File_Enum_Removed, enum1->full_name(), "");
         }
     }
 
@@ -527,66 +1126,193 @@ void Comparison::compare(Source & source1, Source & source2)
         auto * enum1 = file1->FindEnumTypeByName(enum2->name());
         if (!enum1)
         {
-            root.add_item(File_Enum_Added, "", enum2->full_name());
+            add_item(working, section, File_Enum_Added, "", enum2->full_name());
+        }
+    }
+}
+
+void Comparison::compare_files(Source & source1, Source & source2)
+{
+    use_fingerprints(source1, source2);
+    for (auto * file : source1.files())
+        index_roles(file);
+    for (auto * file : source2.files())
+        index_roles(file);
+
+    // Each file pair's section with its top-level pairs.
+    vector<pair<Index, vector<Entry*>>> groups;
+
+    // Both lists are sorted by name. Looking a missing file up in the other
+    // pool instead would try to import it and report an error.
+    auto & files1 = source1.files();
+    auto & files2 = source2.files();
+    vector<const FileDescriptor*> added;
+    size_t i = 0, j = 0;
+    while (i < files1.size() || j < files2.size())
+    {
+        if (j == files2.size() || (i < files1.size() && files1[i]->name() < files2[j]->name()))
+        {
+            add_item(working, 0, File_Removed, files1[i++]->name(), "");
+        }
+        else if (i == files1.size() || files2[j]->name() < files1[i]->name())
+        {
+            added.push_back(files2[j++]);
+        }
+        else
+        {
+            auto * file1 = files1[i++];
+            auto * file2 = files2[j++];
+            groups.emplace_back(working.add_section(0, File_Comparison, file1->name(), file2->name()), vector<Entry*>());
+            collect(file1, file2, groups.back().first, groups.back().second);
+        }
+    }
+
+    for (auto * file2 : added)
+        add_item(working, 0, File_Added, "", file2->name());
+
+    run();
+
+    if (options.fail_fast)
+        return;
+
+    // A type can be referred to from any file, so nothing is passed on
+    // before all of them are placed. Each pair goes under the first file
+    // that leads to it.
+    count_referrers();
+    for (auto & group : groups)
+    {
+        for (auto * entry : group.second)
+        {
+            if (entry->state == Entry::Pending)
+                place(*entry, group.first);
         }
     }
+
+    auto & out = sink();
+    out.begin_section(Root_Section, "", "");
+    for (auto & item : working.items(0))
+        out.item(item.type, item.a, item.b);
+    for (auto & group : groups)
+        working.emit(group.first, out);
+    out.end_section();
+
+    unflushed.clear();
+    working.clear(true);
+    working.add_section(None, Root_Section, "", "");
 }
 
 void Comparison::compare(Source & source1, const string & name1, Source & source2, const string &name2)
 {
+    use_fingerprints(source1, source2);
+    index_roles(source1.file_descriptor());
+    index_roles(source2.file_descriptor());
+
     auto desc1 = source1.pool()->FindMessageTypeByName(name1);
     auto desc2 = source2.pool()->FindMessageTypeByName(name2);
 
     auto enum1 = source1.pool()->FindEnumTypeByName(name1);
     auto enum2 = source2.pool()->FindEnumTypeByName(name2);
 
+    vector<Entry*> top_level;
+
     if (desc1 && desc2)
     {
-        MessageType desc1type = getMessageType(desc1->full_name());
-        MessageType desc2type = getMessageType(desc2->full_name());
-        compare(desc1, desc1type, desc2, desc2type);
+        MessageType desc1type = getMessageType(desc1);
+        MessageType desc2type = getMessageType(desc2);
+        top_level.push_back(claim(desc1, desc1type, desc2, desc2type));
     }
     else if (enum1 && enum2)
     {
-        compare(enum1, enum2);
+        top_level.push_back(claim(enum1, enum2));
     }
     else
     {
-        root.add_item(Name_Missing, name1, name2);
+        add_item(working, 0, Name_Missing, name1, name2);
     }
+
+    finish(top_level);
 }
 
 void Comparison::print_lists()
 {
     //For Debug
+    list<string> inputMessages;
+    list<string> outputMessages;
+
+    for (auto & entry : roles)
+    {
+        if (entry.second & Request_Role)
+            inputMessages.push_back(string(entry.first));
+        if (entry.second & Response_Role)
+            outputMessages.push_back(string(entry.first));
+    }
+
+    inputMessages.sort();
+    outputMessages.sort();
+
     cout << "Input  Messages: " << endl;
 
-    for(auto message : this->inputMessages)
+    for(auto message : inputMessages)
     {
         cout << message << endl;
     }
 
     cout << "Output  Messages: " << endl;
 
-    for (auto message : this->outputMessages)
+    for (auto message : outputMessages)
     {
         cout << message << endl;
     }
 }
 
-Comparison::MessageType Comparison::getMessageType(const string messageName) const
+void Comparison::index_roles(const FileDescriptor * file)
 {
-	if(find(inputMessages.begin(), inputMessages.end(), messageName) != inputMessages.end())
-	{
-        if (find(outputMessages.begin(), outputMessages.end(), messageName) != outputMessages.end())
+    // Every message reachable through fields from a method's input or
+    // output type shares that role, so nested messages are covered too.
+    // Roles are kept by name, so that both versions of a message share the
+    // roles it has in either file.
+    vector<pair<const Descriptor*, unsigned char>> pending;
+
+    for (int i = 0; i < file->service_count(); ++i)
+    {
+        auto * service = file->service(i);
+        for (int x = 0; x < service->method_count(); ++x)
         {
-            return Comparison::Undefined;
-        }else
+            auto * method = service->method(x);
+            pending.emplace_back(method->input_type(), Request_Role);
+            pending.emplace_back(method->output_type(), Response_Role);
+        }
+    }
+
+    while (!pending.empty())
+    {
+        auto * message = pending.back().first;
+        auto role = pending.back().second;
+        pending.pop_back();
+
+        auto & bits = roles[message->full_name()];
+        if ((bits & role) == role)
+            continue;
+        bits |= role;
+
+        for (int i = 0; i < message->field_count(); ++i)
         {
-            return Comparison::InputMessage;
+            if (auto * type = message->field(i)->message_type())
+                pending.emplace_back(type, role);
         }
-	}else
-	{
+    }
+}
+
+Comparison::MessageType Comparison::getMessageType(const Descriptor * message) const
+{
+    auto it = roles.find(message->full_name());
+    unsigned char bits = it == roles.end() ? 0 : it->second;
+
+    // Messages that no method reaches count as responses.
+    if (!(bits & Request_Role))
         return Comparison::OutputMessage;
-	}
+    // Used both as a request and a response.
+    if (bits & Response_Role)
+        return Comparison::Undefined;
+    return Comparison::InputMessage;
 }
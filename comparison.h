@@ -1,75 +1,36 @@
-#include <google/protobuf/compiler/importer.h>
+#pragma once
+
+#include "source.h"
+#include "pair_map.h"
+#include "stats.h"
+#include "trace.h"
+#include "thread_pool.h"
+
 #include <google/protobuf/descriptor.h>
 
 #include <iostream>
 #include <sstream>
 #include <memory>
+#include <atomic>
+#include <cstdint>
+#include <deque>
 #include <list>
+#include <mutex>
+#include <string_view>
 #include <unordered_map>
+#include <vector>
 
 using std::string;
+using std::string_view;
 using std::list;
 using std::shared_ptr;
 using std::unordered_map;
+using std::vector;
 
 using google::protobuf::Descriptor;
 using google::protobuf::FieldDescriptor;
 using google::protobuf::EnumDescriptor;
-
-class ErrorCollector : public google::protobuf::compiler::MultiFileErrorCollector
-{
-public:
-    ErrorCollector() {}
-
-    void AddError(const std::string & filename, int line, int column, const std::string & message) override
-    {
-        using namespace std;
-        cerr << "Error: " << filename << "@" << line << "," << column << ": " << message << endl;
-    }
-
-    void AddWarning(const std::string & filename, int line, int column, const std::string & message) override
-    {
-        using namespace std;
-        cerr << "Warning: " << filename << "@" << line << "," << column << ": " << message << endl;
-    }
-};
-
-class Source
-{
-    using DiskSourceTree = google::protobuf::compiler::DiskSourceTree;
-    using Importer = google::protobuf::compiler::Importer;
-    using DescriptorPool = google::protobuf::DescriptorPool;
-    using FileDescriptor = google::protobuf::FileDescriptor;
-
-public:
-    Source() {}
-    Source(const string & file_path, const string & root_dir)
-    {
-        source_tree.MapPath("", root_dir);
-
-        ErrorCollector error_collector;
-
-        importer = std::make_shared<Importer>(&source_tree, &error_collector);
-
-        d_file_descriptor = importer->Import(file_path);
-        if (!d_file_descriptor)
-        {
-            throw std::runtime_error("Failed to load source.");
-        }
-    }
-
-    const FileDescriptor * file_descriptor() const { return d_file_descriptor; }
-    const DescriptorPool * pool() const { return importer->pool(); }
-
-    list<string> * requestMessages;
-    list<string> * responseMessages;
-
-private:
-    DiskSourceTree source_tree;
-    ErrorCollector error_collector;
-    shared_ptr<Importer> importer;
-    const FileDescriptor * d_file_descriptor = nullptr;
-};
+using google::protobuf::FileDescriptor;
 
 class Comparison
 {
@@ -99,15 +60,22 @@ public:
         Optional_OutputMessage_Field_Added,
         Optional_OutputMessage_Field_Removed,
         Optional_InputMessage_Field_Added,
-        Optional_InputMessage_Field_Removed
+        Optional_InputMessage_Field_Removed,
+        File_Added,
+        File_Removed
     };
 
+    // Index of a record in one of the report's vectors.
+    typedef uint32_t Index;
+    static constexpr Index None = ~Index(0);
+
     struct Item
     {
-        Item(ItemType t, const string & a, const string & b): type(t), a(a), b(b) {}
+        Item(ItemType t, string_view a, string_view b): type(t), a(a), b(b) {}
         ItemType type;
-        string a;
-        string b;
+        string_view a;
+        string_view b;
+        Index next = None;
 
         string message() const;
     };
@@ -118,57 +86,197 @@ public:
         Message_Comparison,
         Message_Field_Comparison,
         Enum_Comparison,
-        Enum_Value_Comparison
+        Enum_Value_Comparison,
+        File_Comparison,
+        Version_Comparison
+    };
+
+    // "Required by <a> -> <b>"
+    struct Note
+    {
+        Note(string_view a, string_view b): a(a), b(b) {}
+        string_view a;
+        string_view b;
+        Index next = None;
     };
 
     struct Section
     {
-        Section(SectionType t, const string & a, const string & b):
-            type(t), a(a), b(b) {}
+        Section(SectionType t, string_view a, string_view b, Index parent):
+            type(t), a(a), b(b), parent(parent) {}
 
         SectionType type;
-        string a;
-        string b;
+        string_view a;
+        string_view b;
+
+        Index parent;
+        Index next = None;
+        Index first_subsection = None;
+        Index last_subsection = None;
+        Index first_item = None;
+        Index last_item = None;
+        Index first_note = None;
+        Index last_note = None;
 
-        list<string> notes;
-        list<Section> subsections;
-        list<Item> items;
+        string message() const;
+    };
 
-        Section & add_subsection(SectionType t, const string & a, const string & b)
+    // Records of one kind linked through their 'next' index, e.g. the items of a section.
+    template <typename T>
+    class Chain
+    {
+    public:
+        class iterator
         {
-            subsections.emplace_back(t, a, b);
-            return subsections.back();
-        }
-
-        void add_item(ItemType t, const string & a, const string & b)
+        public:
+            iterator(const vector<T> & records, Index index): records(&records), index(index) {}
+            const T & operator*() const { return (*records)[index]; }
+            const T * operator->() const { return &(*records)[index]; }
+            iterator & operator++() { index = (*records)[index].next; return *this; }
+            bool operator!=(const iterator & other) const { return index != other.index; }
+            bool operator==(const iterator & other) const { return index == other.index; }
+
+        private:
+            const vector<T> * records;
+            Index index;
+        };
+
+        Chain(const vector<T> & records, Index first): records(records), first(first) {}
+
+        iterator begin() const { return iterator(records, first); }
+        iterator end() const { return iterator(records, None); }
+        bool empty() const { return first == None; }
+        size_t size() const
         {
-            items.emplace_back(t, a, b);
+            size_t count = 0;
+            for (auto it = begin(); it != end(); ++it)
+                ++count;
+            return count;
         }
 
-        bool is_empty() const { return subsections.empty() && items.empty(); }
+    private:
+        const vector<T> & records;
+        Index first;
+    };
+
+    // Receives the result as the comparison produces it. Each section comes
+    // as begin_section(), its notes and items, its subsections, and then
+    // end_section(); sections without any items below them are left out.
+    // The root section opens first and closes when the comparison is done.
+    // Names point into the descriptor pools of the compared Sources, other
+    // text into the Comparison; both stay valid while those live.
+    class Sink
+    {
+    public:
+        virtual ~Sink() {}
+        virtual void begin_section(SectionType type, string_view a, string_view b) = 0;
+        // "Required by <a> -> <b>"
+        virtual void note(string_view a, string_view b) = 0;
+        virtual void item(ItemType type, string_view a, string_view b) = 0;
+        virtual void end_section() = 0;
+    };
 
-        void trim()
+    // The comparison result: sections, items and notes stored flat in
+    // vectors and linked by index. Names point into the descriptor pools
+    // of the compared Sources, which have to outlive the report; other
+    // text, such as field numbers, is copied into blocks the report owns.
+    // As a Sink, it builds the tree it receives.
+    //
+    // A section can also be deferred: it is kept on a stack of pending
+    // sections and only added, along with any pending sections above it,
+    // once something is added to it or below it. Comparing a pair of fields
+    // or enum values that didn't change then adds nothing.
+    class Report : public Sink
+    {
+    public:
+        void begin_section(SectionType type, string_view a, string_view b) override;
+        void note(string_view a, string_view b) override;
+        void item(ItemType type, string_view a, string_view b) override;
+        void end_section() override;
+
+        Index add_section(Index parent, SectionType type, string_view a, string_view b);
+        // Inserts a subsection of 'parent' right after 'previous', or first if 'previous' is None.
+        Index insert_section(Index parent, Index previous, SectionType type, string_view a, string_view b);
+        // Returns a stand-in index for a section that is added once it is used, until end_deferred().
+        // 'parent' may be deferred itself.
+        Index defer_section(Index parent, SectionType type, string_view a, string_view b);
+        // Ends the innermost deferred section. Returns its index, or None if it was never added.
+        Index end_deferred();
+        void add_item(Index section, ItemType type, string_view a, string_view b);
+        // Inserts before the section's first item of type 'before', or at the end.
+        void insert_item(Index section, ItemType type, string_view a, string_view b, ItemType before);
+        void add_note(Index section, string_view a, string_view b);
+
+        // Moves the records of 'fragment' over, linking its first section
+        // under 'parent'. Returns the new index of that section.
+        Index append(Report & fragment, Index parent);
+
+        // Copies text that does not come from a descriptor.
+        string_view store(string_view text);
+
+        const Section & section(Index index) const { return section_records[index]; }
+        Chain<Section> subsections(Index section) const { return { section_records, section_records[section].first_subsection }; }
+        Chain<Item> items(Index section) const { return { item_records, section_records[section].first_item }; }
+        Chain<Note> notes(Index section) const { return { note_records, section_records[section].first_note }; }
+        bool empty() const { return section_records.empty(); }
+        size_t section_count() const { return section_records.size(); }
+        size_t item_count() const { return item_records.size(); }
+
+        // Whether there are items in the section or below it.
+        bool has_items(Index section) const;
+        // Sends the section and what is below it to 'sink'.
+        void emit(Index section, Sink & sink) const;
+
+        // Writes the whole tree to stdout, as text.
+        void print() const;
+        void clear(bool keep_text = false);
+
+    private:
+        vector<Section> section_records;
+        vector<Item> item_records;
+        vector<Note> note_records;
+        vector<std::unique_ptr<char[]>> text_blocks;
+        size_t text_left = 0;
+        char * text_end = nullptr;
+        // Sections received as a Sink and not yet ended.
+        vector<Index> open_sections;
+
+        struct Deferred
         {
-            auto s = subsections.begin();
-            while (s != subsections.end())
-            {
-                s->trim();
-                if (s->is_empty())
-                    s = subsections.erase(s);
-                else
-                    ++s;
-            }
-        }
+            Index parent;
+            SectionType type;
+            string_view a;
+            string_view b;
+            // In section_records, once added.
+            Index index;
+        };
 
-        string message() const;
+        // Deferred sections stand in as this bit plus their position in 'deferred'.
+        static constexpr Index Deferred_Bit = Index(1) << 31;
+        static bool is_deferred(Index index) { return index != None && (index & Deferred_Bit); }
+
+        // The section 'index' stands for, adding it first if it is deferred.
+        Index resolve(Index index);
 
-        void print(int level = 0);
+        vector<Deferred> deferred;
+
+        void send(Index section, Sink & sink, bool skip_empty) const;
     };
 
     struct Options
     {
         Options() {}
         bool binary = false;
+        // Number of threads comparing message and enum pairs, including the caller's.
+        unsigned jobs = 1;
+        // Only look for the first breaking change (see is_breaking()), without building a report.
+        bool fail_fast = false;
+        // Receives the result instead of 'report', a top-level message or enum at a time.
+        Sink * sink = nullptr;
+        // Counts the work done, if set.
+        Stats * stats = nullptr;
+        // Records a span for each pair of messages or enums compared, if set.
+        Trace * trace = nullptr;
     };
 
     enum MessageType
@@ -180,23 +288,144 @@ public:
 
     Comparison(const Options & options = Options{});
 
+    // Text for a type of item or section, as in "<label>: <a> -> <b>"; null for an unknown type.
+    static const char * label(ItemType type);
+    static const char * label(SectionType type);
+
     void compare(Source & source1, Source & source2);
     void compare(Source & source1, const string & name1, Source & source2, const string &name2);
-    Section * compare(const EnumDescriptor * enum1, const EnumDescriptor * enum2);
-    Section * compare(const Descriptor * desc1, MessageType desc1type, const Descriptor * desc2, MessageType desc2type);
-    Section compare(const FieldDescriptor * field1, const FieldDescriptor * field2);
+    // Compares the files of two sources from Source::load_directory(), matched by path.
+    // Every file pair gets a section; pairs of types are compared once, concurrently.
+    void compare_files(Source & source1, Source & source2);
     bool compare_default_value(const FieldDescriptor * field1, const FieldDescriptor * field2);
 
-    void print_lists();
+    // Whether a change breaks existing readers or writers of the binary
+    // (with Options::binary) or JSON serialization. A Message_Field_Type_Changed
+    // item for a field whose referenced message or enum changed is breaking
+    // only if that message or enum has a breaking change itself.
+    bool is_breaking(ItemType type) const;
+
+    // With Options::fail_fast: the breaking change that stopped the comparison, or null if there was none.
+    const Item * first_breaking() const;
 
-    Section root { Root_Section, "", "" };
+    void print_lists();
 
-    unordered_map<string, Section*> compared;
+    // The result, unless Options::sink is set. Section 0 is the root.
+    Report report;
 
 private:
-    MessageType getMessageType(const string messageName) const;
+    struct Entry;
+
+    // A field whose type is itself a compared pair of messages or enums.
+    // Whether that makes the field's type changed is settled in place().
+    struct Reference
+    {
+        // In the entry's fragment until placed; None if the field had no changes of its own.
+        Index field_section;
+        Entry * target;
+        const FieldDescriptor * field1;
+        const FieldDescriptor * field2;
+        // Whether the referring message had changes before this field.
+        bool changed_before;
+        // Without a field section, the one before where it would be, or None if it would be first.
+        Index previous_section = None;
+    };
+
+    // A pair of messages or enums. Pairs are compared independently of
+    // each other, possibly on different threads; place() then links the
+    // results under root in a fixed order.
+    struct Entry
+    {
+        enum State
+        {
+            Pending,
+            Placing,
+            Placed
+        };
+
+        const Descriptor * desc1 = nullptr;
+        const Descriptor * desc2 = nullptr;
+        MessageType desc1type = Undefined;
+        MessageType desc2type = Undefined;
+        const EnumDescriptor * enum1 = nullptr;
+        const EnumDescriptor * enum2 = nullptr;
+
+        // Holds the section until it is appended to the report. Stays empty
+        // for a pair without changes that refers to no other pair.
+        Report fragment;
+        // In the report, once placed; None without a section.
+        Index section = None;
+        vector<Reference> references;
+        // Items in the section or its field sections, not counting referenced types.
+        bool local_changes = false;
+
+        State state = Pending;
+        bool changed_so_far = false;
+        bool changed = false;
+        // References to this pair not yet placed; each adds a note to its section.
+        unsigned referrers = 0;
+    };
+
+    Entry * claim(const EnumDescriptor * enum1, const EnumDescriptor * enum2);
+    Entry * claim(const Descriptor * desc1, MessageType desc1type, const Descriptor * desc2, MessageType desc2type);
+    Entry * new_entry();
+    void compare_enums(Entry & entry);
+    void compare_messages(Entry & entry);
+    void compare(const FieldDescriptor * field1, const FieldDescriptor * field2, Report & out, Index section,
+                 Entry & entry, bool changed_before);
+    void collect(const FileDescriptor * file1, const FileDescriptor * file2, Index section,
+                 vector<Entry*> & top_level);
+    void run();
+    void count_referrers();
+    void finish(const vector<Entry*> & top_level);
+    void place(Entry & entry, Index parent);
+    void flush();
+    Sink & sink() { return options.sink ? *options.sink : report; }
+    WorkStealingPool & workers();
+    void add_item(Report & out, Index section, ItemType type, string_view a, string_view b);
+    Report & output(Entry & entry);
+    string_view id_of(Report & out, const FieldDescriptor * field) const;
+    string_view id_of(Report & out, const google::protobuf::EnumValueDescriptor * value) const;
+    bool stopped() const { return stop; }
+    void count(Stats::Counter counter, uint64_t amount = 1)
+    {
+        if (options.stats)
+            options.stats->add(counter, amount);
+    }
+
+    // Bits of 'roles': whether a message is used by an RPC method as (part of) a request or a response.
+    enum
+    {
+        Request_Role = 1,
+        Response_Role = 2
+    };
+
+    void index_roles(const FileDescriptor * file);
+    MessageType getMessageType(const Descriptor * message) const;
+    void use_fingerprints(Source & source1, Source & source2);
+    bool identical(const Descriptor * desc1, const Descriptor * desc2) const;
+    bool identical(const EnumDescriptor * enum1, const EnumDescriptor * enum2) const;
+
+    // Set while comparing two Sources; null when comparing bare descriptors.
+    Fingerprints * fingerprints1 = nullptr;
+    Fingerprints * fingerprints2 = nullptr;
     Options options;
-    list<string> inputMessages;
-    list<string> outputMessages;
+    // By full name; the names point into the compared Sources' pools.
+    unordered_map<string_view, unsigned char> roles;
+
+    // The message and enum pairs compared so far.
+    ConcurrentPairMap<Entry*> compared;
+    std::deque<Entry> entries;
+    std::mutex entries_mutex;
+    unique_ptr<WorkStealingPool> pool;
+
+    // Sections are placed here and passed on to the sink once complete:
+    // when all references to their pair are placed, and all before them are passed on.
+    Report working;
+    std::deque<Entry*> unflushed;
+
+    // Set by a fail-fast check once a breaking change is found.
+    std::atomic<bool> stop { false };
+    unique_ptr<Item> breaking_item;
 
 };
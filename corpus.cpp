@@ -0,0 +1,68 @@
+#include "corpus.h"
+
+#include <algorithm>
+#include <atomic>
+#include <stdexcept>
+#include <thread>
+
+using namespace std;
+
+Corpus::Corpus(const string & path, size_t batch_size)
+{
+    if (!d_file.open(path))
+        throw std::runtime_error("Failed to read corpus: " + path);
+
+    const uint8_t * pos = d_file.data();
+    const uint8_t * end = pos + d_file.size();
+    const uint8_t * batch_begin = pos;
+    while (pos != end)
+    {
+        uint64_t size;
+        if (!read_varint(pos, end, size) || size > uint64_t(end - pos) || size > uint64_t(INT32_MAX))
+        {
+            throw std::runtime_error("Invalid corpus " + path + " at offset " +
+                                     to_string(pos - d_file.data()) + ".");
+        }
+        pos += size;
+
+        if (size_t(pos - batch_begin) >= batch_size)
+        {
+            d_batches.push_back({ batch_begin, pos });
+            batch_begin = pos;
+        }
+    }
+    if (batch_begin != end)
+        d_batches.push_back({ batch_begin, end });
+}
+
+bool Corpus::next(const uint8_t *& pos, const uint8_t * end, const uint8_t *& data, size_t & size)
+{
+    uint64_t length;
+    if (pos == end || !read_varint(pos, end, length))
+        return false;
+
+    // The sizes were checked when the batches were made.
+    data = pos;
+    size = size_t(length);
+    pos += size;
+    return true;
+}
+
+void Corpus::run(unsigned jobs, const function<void(unsigned, const Batch &)> & process) const
+{
+    jobs = max(1u, min(jobs, unsigned(d_batches.size())));
+
+    atomic<size_t> next_batch { 0 };
+    auto work = [this, &process, &next_batch](unsigned worker)
+    {
+        for (size_t index; (index = next_batch++) < d_batches.size(); )
+            process(worker, d_batches[index]);
+    };
+
+    vector<thread> threads;
+    for (unsigned i = 1; i < jobs; ++i)
+        threads.emplace_back(work, i);
+    work(0);
+    for (auto & t : threads)
+        t.join();
+}
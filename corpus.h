@@ -0,0 +1,57 @@
+#pragma once
+
+#include "mapped_descriptor_database.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+// A memory mapped file of length-delimited messages, each preceded by its
+// size as a varint, as written by writeDelimitedTo(). It is split into
+// batches of whole messages, reading nothing but the sizes, so that
+// threads can take a batch at a time.
+class Corpus
+{
+public:
+    struct Batch
+    {
+        const uint8_t * begin;
+        const uint8_t * end;
+    };
+
+    // Throws std::runtime_error if the file cannot be read or a size runs past its end.
+    Corpus(const std::string & path, size_t batch_size = 4 * 1024 * 1024);
+
+    Corpus(const Corpus &) = delete;
+    Corpus & operator=(const Corpus &) = delete;
+
+    const std::vector<Batch> & batches() const { return d_batches; }
+
+    // Calls 'process' for every batch, on up to 'jobs' threads including the
+    // caller's. The first argument tells the threads apart, from 0 to jobs - 1.
+    void run(unsigned jobs, const std::function<void(unsigned, const Batch &)> & process) const;
+
+    // Moves 'pos' past the next message of a batch and sets 'data' and
+    // 'size' to it. Returns false at the end of the batch.
+    static bool next(const uint8_t *& pos, const uint8_t * end, const uint8_t *& data, size_t & size);
+
+    // Reads a varint and moves 'pos' past it. Returns false if it does not end before 'end'.
+    static bool read_varint(const uint8_t *& pos, const uint8_t * end, uint64_t & value)
+    {
+        value = 0;
+        for (int shift = 0; shift < 64 && pos != end; shift += 7)
+        {
+            uint8_t byte = *pos++;
+            value |= uint64_t(byte & 0x7f) << shift;
+            if (!(byte & 0x80))
+                return true;
+        }
+        return false;
+    }
+
+private:
+    MappedFile d_file;
+    std::vector<Batch> d_batches;
+};
@@ -0,0 +1,218 @@
+#include "fingerprint.h"
+
+#include <cstring>
+#include <string>
+#include <unordered_set>
+
+using namespace std;
+
+using google::protobuf::Descriptor;
+using google::protobuf::EnumDescriptor;
+using google::protobuf::FieldDescriptor;
+
+static
+uint64_t mix(uint64_t value)
+{
+    // splitmix64 finalizer
+    value += 0x9e3779b97f4a7c15ull;
+    value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ull;
+    value = (value ^ (value >> 27)) * 0x94d049bb133111ebull;
+    return value ^ (value >> 31);
+}
+
+static
+uint64_t combine(uint64_t seed, uint64_t value)
+{
+    return mix(seed ^ mix(value));
+}
+
+static
+uint64_t hash_string(const string & text)
+{
+    uint64_t value = 14695981039346656037ull;
+    for (unsigned char c : text)
+    {
+        value ^= c;
+        value *= 1099511628211ull;
+    }
+    return value;
+}
+
+static
+uint64_t default_value_hash(const FieldDescriptor * field)
+{
+    if (!field->has_default_value())
+        return 0;
+
+    switch(field->cpp_type())
+    {
+    case FieldDescriptor::CPPTYPE_INT32:
+        return mix(uint64_t(field->default_value_int32()));
+    case FieldDescriptor::CPPTYPE_INT64:
+        return mix(uint64_t(field->default_value_int64()));
+    case FieldDescriptor::CPPTYPE_UINT32:
+        return mix(field->default_value_uint32());
+    case FieldDescriptor::CPPTYPE_UINT64:
+        return mix(field->default_value_uint64());
+    // Floating point values by their bits: to_string() rounds to 6 decimals.
+    case FieldDescriptor::CPPTYPE_FLOAT:
+    {
+        float value = field->default_value_float();
+        uint32_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        return mix(bits);
+    }
+    case FieldDescriptor::CPPTYPE_DOUBLE:
+    {
+        double value = field->default_value_double();
+        uint64_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        return mix(bits);
+    }
+    case FieldDescriptor::CPPTYPE_BOOL:
+        return mix(field->default_value_bool() ? 2 : 1);
+    case FieldDescriptor::CPPTYPE_STRING:
+        return hash_string(field->default_value_string());
+    case FieldDescriptor::CPPTYPE_ENUM:
+        return mix(uint64_t(field->default_value_enum()->number()));
+    default:
+        return 0;
+    }
+}
+
+uint64_t Fingerprints::of(const EnumDescriptor * enum_type)
+{
+    lock_guard<mutex> lock(values_mutex);
+    return enum_hash(enum_type);
+}
+
+uint64_t Fingerprints::enum_hash(const EnumDescriptor * enum_type)
+{
+    auto it = values.find(enum_type);
+    if (it != values.end())
+        return it->second;
+
+    // Values are summed so that their order doesn't matter.
+    uint64_t sum = 0;
+    for (int i = 0; i < enum_type->value_count(); ++i)
+    {
+        auto * value = enum_type->value(i);
+        sum += combine(hash_string(value->name()), uint64_t(value->number()));
+    }
+
+    uint64_t result = combine(hash_string(enum_type->full_name()), sum);
+    values.emplace(enum_type, result);
+    return result;
+}
+
+uint64_t Fingerprints::of(const Descriptor * message)
+{
+    lock_guard<mutex> lock(values_mutex);
+
+    auto it = values.find(message);
+    if (it != values.end())
+        return it->second;
+
+    visit(message);
+
+    visits.clear();
+    next_index = 0;
+
+    return values.at(message);
+}
+
+void Fingerprints::visit(const Descriptor * message)
+{
+    auto & state = visits[message];
+    state.index = state.low_link = next_index++;
+    state.on_stack = true;
+    stack.push_back(message);
+
+    for (int i = 0; i < message->field_count(); ++i)
+    {
+        auto * target = message->field(i)->message_type();
+        if (!target || values.count(target))
+            continue;
+
+        auto found = visits.find(target);
+        if (found == visits.end())
+        {
+            visit(target);
+            auto & own = visits[message];
+            own.low_link = min(own.low_link, visits[target].low_link);
+        }
+        else if (found->second.on_stack)
+        {
+            auto & own = visits[message];
+            own.low_link = min(own.low_link, found->second.index);
+        }
+    }
+
+    auto & own = visits[message];
+    if (own.low_link != own.index)
+        return;
+
+    // 'message' is the root of a strongly connected component, which
+    // is everything on the stack down to it.
+    unordered_set<const Descriptor*> component;
+    const Descriptor * member;
+    do
+    {
+        member = stack.back();
+        stack.pop_back();
+        visits[member].on_stack = false;
+        component.insert(member);
+    }
+    while (member != message);
+
+    unordered_map<const Descriptor*, uint64_t> local;
+    uint64_t component_hash = 0;
+    for (auto * descriptor : component)
+    {
+        uint64_t value = local_hash(descriptor, component);
+        local.emplace(descriptor, value);
+        component_hash += value;
+    }
+
+    for (auto & entry : local)
+    {
+        values.emplace(entry.first, combine(entry.second, component_hash));
+    }
+}
+
+uint64_t Fingerprints::local_hash(const Descriptor * message, const unordered_set<const Descriptor*> & component)
+{
+    uint64_t sum = 0;
+    for (int i = 0; i < message->field_count(); ++i)
+    {
+        sum += field_hash(message->field(i), component);
+    }
+
+    return combine(hash_string(message->full_name()), sum);
+}
+
+uint64_t Fingerprints::field_hash(const FieldDescriptor * field, const unordered_set<const Descriptor*> & component)
+{
+    uint64_t value = hash_string(field->name());
+    value = combine(value, uint64_t(field->number()));
+    value = combine(value, uint64_t(field->label()));
+    value = combine(value, uint64_t(field->type()));
+    value = combine(value, field->has_optional_keyword() ? 1 : 0);
+    value = combine(value, default_value_hash(field));
+
+    if (auto * message = field->message_type())
+    {
+        // Within a cycle, a reference stands for the type by name; the
+        // component hash covers the structure of every type in the cycle.
+        if (component.count(message))
+            value = combine(value, hash_string(message->full_name()));
+        else
+            value = combine(value, values.at(message));
+    }
+    else if (auto * enum_type = field->enum_type())
+    {
+        value = combine(value, enum_hash(enum_type));
+    }
+
+    return value;
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <google/protobuf/descriptor.h>
+
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// Structural hashes of message and enum types, for telling identical
+// types apart from changed ones without comparing them.
+//
+// A fingerprint covers everything Comparison looks at: the type's name,
+// and for each field its name, number, label, type, default value and
+// the fingerprint of any referenced message or enum type. Field and
+// value order does not matter. Types that reference each other in a cycle
+// are hashed per strongly connected component, so that a change anywhere
+// in the cycle changes the fingerprint of every type in it.
+//
+// If two types have the same fingerprint, comparing them reports nothing.
+// Fingerprints are computed on demand and kept for the life of the object,
+// so one instance should be kept per descriptor pool. It may be used from
+// several threads at once.
+class Fingerprints
+{
+    using Descriptor = google::protobuf::Descriptor;
+    using EnumDescriptor = google::protobuf::EnumDescriptor;
+    using FieldDescriptor = google::protobuf::FieldDescriptor;
+
+public:
+    uint64_t of(const Descriptor * message);
+    uint64_t of(const EnumDescriptor * enum_type);
+
+private:
+    struct Visit
+    {
+        int index;
+        int low_link;
+        bool on_stack;
+    };
+
+    uint64_t enum_hash(const EnumDescriptor * enum_type);
+    void visit(const Descriptor * message);
+    uint64_t local_hash(const Descriptor * message, const std::unordered_set<const Descriptor*> & component);
+    uint64_t field_hash(const FieldDescriptor * field, const std::unordered_set<const Descriptor*> & component);
+
+    std::mutex values_mutex;
+    std::unordered_map<const void*, uint64_t> values;
+
+    // Tarjan's algorithm state, only used while computing.
+    std::unordered_map<const Descriptor*, Visit> visits;
+    std::vector<const Descriptor*> stack;
+    int next_index = 0;
+};
@@ -0,0 +1,230 @@
+#include "git_source_tree.h"
+
+#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
+
+#include <stdexcept>
+
+#ifndef _WIN32
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+using google::protobuf::io::ArrayInputStream;
+using google::protobuf::io::ZeroCopyInputStream;
+
+namespace {
+
+// An input stream over a blob that it owns.
+class BlobInputStream : public ZeroCopyInputStream
+{
+public:
+    explicit BlobInputStream(string contents):
+        contents(std::move(contents)),
+        stream(this->contents.data(), int(this->contents.size()))
+    {}
+
+    bool Next(const void ** data, int * size) override { return stream.Next(data, size); }
+    void BackUp(int count) override { stream.BackUp(count); }
+    bool Skip(int count) override { return stream.Skip(count); }
+    int64_t ByteCount() const override { return stream.ByteCount(); }
+
+private:
+    string contents;
+    ArrayInputStream stream;
+};
+
+}
+
+GitSourceTree::GitSourceTree(const string & repository, const string & revision, const string & directory):
+    d_repository(repository),
+    d_revision(revision),
+    d_directory(directory)
+{
+    while (!d_directory.empty() && d_directory.back() == '/')
+        d_directory.pop_back();
+}
+
+GitSourceTree::~GitSourceTree()
+{
+    stop(d_contents);
+    stop(d_check);
+}
+
+bool GitSourceTree::is_spec(const string & root)
+{
+    string repository, revision, directory;
+    return parse_spec(root, &repository, &revision, &directory);
+}
+
+bool GitSourceTree::parse_spec(const string & root, string * repository, string * revision, string * directory)
+{
+    auto at = root.find('@');
+    if (at == string::npos || at == 0)
+        return false;
+
+    auto colon = root.find(':', at + 1);
+    if (colon == string::npos || colon == at + 1)
+        return false;
+
+    *repository = root.substr(0, at);
+    *revision = root.substr(at + 1, colon - at - 1);
+    *directory = root.substr(colon + 1);
+    return true;
+}
+
+#ifndef _WIN32
+// A pipe whose ends are closed on exec. Otherwise a git process started
+// meanwhile on another thread would inherit the write end of this one's
+// input, and this one would never see it closed.
+static
+int close_on_exec_pipe(int fds[2])
+{
+#ifdef __APPLE__
+    // No pipe2() here; this leaves a short window.
+    if (pipe(fds) != 0)
+        return -1;
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    return 0;
+#else
+    return pipe2(fds, O_CLOEXEC);
+#endif
+}
+#endif
+
+void GitSourceTree::start(Process & process, const char * mode)
+{
+#ifndef _WIN32
+    int requests[2];
+    int replies[2];
+    if (close_on_exec_pipe(requests) != 0)
+        throw std::runtime_error("Failed to start git.");
+    if (close_on_exec_pipe(replies) != 0)
+    {
+        close(requests[0]);
+        close(requests[1]);
+        throw std::runtime_error("Failed to start git.");
+    }
+
+    process.pid = fork();
+    if (process.pid == 0)
+    {
+        // The duplicates are kept open on exec.
+        dup2(requests[0], 0);
+        dup2(replies[1], 1);
+        close(requests[0]);
+        close(requests[1]);
+        close(replies[0]);
+        close(replies[1]);
+        execlp("git", "git", "-C", d_repository.c_str(), "cat-file", mode, (char*) nullptr);
+        _exit(127);
+    }
+
+    close(requests[0]);
+    close(replies[1]);
+
+    if (process.pid < 0)
+    {
+        close(requests[1]);
+        close(replies[0]);
+        throw std::runtime_error("Failed to start git.");
+    }
+
+    process.requests = fdopen(requests[1], "w");
+    process.replies = fdopen(replies[0], "r");
+#else
+    (void) process;
+    (void) mode;
+    throw std::runtime_error("Reading from git is not supported on this platform.");
+#endif
+}
+
+void GitSourceTree::stop(Process & process)
+{
+#ifndef _WIN32
+    // Closing its input ends the git process.
+    if (process.requests)
+        fclose(process.requests);
+    if (process.replies)
+        fclose(process.replies);
+    if (process.pid > 0)
+        waitpid(process.pid, nullptr, 0);
+#endif
+}
+
+bool GitSourceTree::request(Process & process, const string & filename, string * id, string * type, size_t * size)
+{
+    string object = d_revision + ":" + (d_directory.empty() ? filename : d_directory + "/" + filename);
+    fputs(object.c_str(), process.requests);
+    fputc('\n', process.requests);
+    fflush(process.requests);
+
+    // "<id> <type> <size>", or "<object> missing".
+    string header;
+    int c;
+    while ((c = fgetc(process.replies)) != EOF && c != '\n')
+        header += char(c);
+    if (c == EOF)
+        throw std::runtime_error("git cat-file failed in " + d_repository);
+
+    auto space = header.find(' ');
+    auto type_end = header.find(' ', space + 1);
+    if (space == string::npos || type_end == string::npos)
+    {
+        d_last_error = "File not found in " + d_repository + " at " + d_revision + ".";
+        return false;
+    }
+
+    *id = header.substr(0, space);
+    *type = header.substr(space + 1, type_end - space - 1);
+    *size = stoul(header.substr(type_end + 1));
+    return true;
+}
+
+ZeroCopyInputStream * GitSourceTree::Open(const string & filename)
+{
+    if (!d_contents.requests)
+        start(d_contents, "--batch");
+
+    string id, type;
+    size_t size;
+    if (!request(d_contents, filename, &id, &type, &size))
+        return nullptr;
+
+    // The contents and a newline follow the header.
+    string contents(size, '\0');
+    if (size && fread(&contents[0], 1, size, d_contents.replies) != size)
+        throw std::runtime_error("git cat-file failed in " + d_repository);
+    fgetc(d_contents.replies);
+
+    if (type != "blob")
+    {
+        d_last_error = "Not a file in " + d_repository + " at " + d_revision + ".";
+        return nullptr;
+    }
+
+    d_ids[filename] = id;
+    return new BlobInputStream(std::move(contents));
+}
+
+string GitSourceTree::blob_id(const string & filename)
+{
+    auto it = d_ids.find(filename);
+    if (it != d_ids.end())
+        return it->second;
+
+    if (!d_check.requests)
+        start(d_check, "--batch-check");
+
+    string id, type;
+    size_t size;
+    if (!request(d_check, filename, &id, &type, &size) || type != "blob")
+        return string();
+
+    d_ids[filename] = id;
+    return id;
+}
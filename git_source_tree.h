@@ -0,0 +1,62 @@
+#pragma once
+
+#include <google/protobuf/compiler/importer.h>
+#include <google/protobuf/io/zero_copy_stream.h>
+
+#include <cstdio>
+#include <map>
+#include <string>
+
+// A SourceTree that reads files from a revision in a local git repository,
+// without a checkout. Blobs come from a long-running 'git cat-file --batch'
+// process, and blob ids from a 'git cat-file --batch-check' one, each
+// started on first use.
+//
+// A spec "<repository>@<revision>:<directory>" names the tree: files are
+// looked up as "<revision>:<directory>/<file>" in <repository>. The
+// directory part may be empty.
+class GitSourceTree : public google::protobuf::compiler::SourceTree
+{
+public:
+    GitSourceTree(const std::string & repository, const std::string & revision, const std::string & directory);
+    ~GitSourceTree();
+
+    GitSourceTree(const GitSourceTree &) = delete;
+    GitSourceTree & operator=(const GitSourceTree &) = delete;
+
+    // Whether 'root' is a spec rather than a path.
+    static bool is_spec(const std::string & root);
+    // Splits a spec into its parts. Returns false if it is not one.
+    static bool parse_spec(const std::string & root, std::string * repository,
+                           std::string * revision, std::string * directory);
+
+    google::protobuf::io::ZeroCopyInputStream * Open(const std::string & filename) override;
+    std::string GetLastErrorMessage() override { return d_last_error; }
+
+    // The git object id of 'filename', or an empty string if there is no such file.
+    // Equal ids mean equal contents, whichever revision the files are in.
+    std::string blob_id(const std::string & filename);
+
+private:
+    struct Process
+    {
+        FILE * requests = nullptr;
+        FILE * replies = nullptr;
+        int pid = -1;
+    };
+
+    void start(Process & process, const char * mode);
+    void stop(Process & process);
+    // Asks about 'filename' and reads the header of the reply. Returns false if there is no such object.
+    bool request(Process & process, const std::string & filename,
+                 std::string * id, std::string * type, size_t * size);
+
+    std::string d_repository;
+    std::string d_revision;
+    std::string d_directory;
+    std::string d_last_error;
+    std::map<std::string, std::string> d_ids;
+
+    Process d_contents;
+    Process d_check;
+};
@@ -1,29 +1,564 @@
+#include "census.h"
 #include "comparison.h"
+#include "replay.h"
+#include "report_writer.h"
+#include "server.h"
+#include "stats.h"
+#include "watcher.h"
 
+#include <csignal>
+#include <cstdlib>
+#include <fstream>
+#include <string_view>
+#include <future>
 #include <iostream>
+#include <map>
+#include <vector>
 
 using namespace std;
 
+// Loads both sides of the comparison. With 'parallel' set, each Source is
+// parsed on its own thread and diagnostics are held back per side, then
+// written out side by side once both imports are done.
+static
+void load_sources(unique_ptr<Source> & source1, unique_ptr<Source> & source2,
+                  char * argv[], Source::Options source_options, bool parallel, bool share_imports)
+{
+    if (share_imports && !Source::is_descriptor_set(argv[1]) && !Source::is_descriptor_set(argv[3]) &&
+            !source_options.descriptor_set)
+    {
+        Source::load_shared(argv[2], argv[1], argv[4], argv[3], source_options, source1, source2);
+        return;
+    }
+
+    if (!parallel)
+    {
+        source1.reset(new Source(argv[2], argv[1], source_options));
+        source2.reset(new Source(argv[4], argv[3], source_options));
+        return;
+    }
+
+    source_options.buffer_errors = true;
+
+    auto load = [source_options](const string & file_path, const string & root)
+    {
+        return unique_ptr<Source>(new Source(file_path, root, source_options));
+    };
+
+    auto future1 = async(launch::async, load, string(argv[2]), string(argv[1]));
+    auto future2 = async(launch::async, load, string(argv[4]), string(argv[3]));
+
+    // Wait for both sides before rethrowing, so neither thread outlives main.
+    future1.wait();
+    future2.wait();
+
+    source1 = future1.get();
+    source2 = future2.get();
+
+    source1->flush_errors();
+    source2->flush_errors();
+}
+
+// Loads every .proto file of two directory trees, one pool per side.
+static
+void load_directories(unique_ptr<Source> & source1, unique_ptr<Source> & source2,
+                      const string & root1, const string & root2, Source::Options source_options, bool parallel)
+{
+    if (!parallel)
+    {
+        source1 = Source::load_directory(root1, source_options);
+        source2 = Source::load_directory(root2, source_options);
+        return;
+    }
+
+    source_options.buffer_errors = true;
+
+    auto future1 = async(launch::async, Source::load_directory, root1, source_options);
+    auto future2 = async(launch::async, Source::load_directory, root2, source_options);
+
+    future1.wait();
+    future2.wait();
+
+    source1 = future1.get();
+    source2 = future2.get();
+
+    source1->flush_errors();
+    source2->flush_errors();
+}
+
+// Passes on the report of one pair of versions as a section of a combined report.
+class VersionSink : public Comparison::Sink
+{
+public:
+    VersionSink(Comparison::Sink & out, const string & root1, const string & root2):
+        out(out), root1(root1), root2(root2) {}
+
+    void begin_section(Comparison::SectionType type, string_view a, string_view b) override
+    {
+        if (type == Comparison::Root_Section)
+            out.begin_section(Comparison::Version_Comparison, root1, root2);
+        else
+            out.begin_section(type, a, b);
+    }
+
+    void note(string_view a, string_view b) override { out.note(a, b); }
+    void item(Comparison::ItemType type, string_view a, string_view b) override { out.item(type, a, b); }
+    void end_section() override { out.end_section(); }
+
+private:
+    Comparison::Sink & out;
+    const string & root1;
+    const string & root2;
+};
+
+// Passes a report on, counting the sections and items that reach the output.
+class CountingSink : public Comparison::Sink
+{
+public:
+    CountingSink(Comparison::Sink & out, Stats & stats): out(out), stats(stats) {}
+
+    void begin_section(Comparison::SectionType type, string_view a, string_view b) override
+    {
+        if (type != Comparison::Root_Section)
+            stats.add(Stats::Sections_Written);
+        out.begin_section(type, a, b);
+    }
+
+    void note(string_view a, string_view b) override { out.note(a, b); }
+
+    void item(Comparison::ItemType type, string_view a, string_view b) override
+    {
+        stats.add(Stats::Items_Written);
+        out.item(type, a, b);
+    }
+
+    void end_section() override { out.end_section(); }
+
+private:
+    Comparison::Sink & out;
+    Stats & stats;
+};
+
+// Loads 'file_path' from each of 'roots', once.
+static
+vector<unique_ptr<Source>> load_versions(const string & file_path, const vector<string> & roots,
+                                         Source::Options source_options, bool parallel)
+{
+    vector<unique_ptr<Source>> sources;
+
+    if (!parallel)
+    {
+        for (auto & root : roots)
+            sources.emplace_back(new Source(file_path, root, source_options));
+        return sources;
+    }
+
+    source_options.buffer_errors = true;
+
+    auto load = [source_options, &file_path](const string & root)
+    {
+        return unique_ptr<Source>(new Source(file_path, root, source_options));
+    };
+
+    vector<future<unique_ptr<Source>>> futures;
+    for (auto & root : roots)
+        futures.push_back(async(launch::async, load, root));
+
+    // Wait for all versions before rethrowing, so no thread outlives main.
+    for (auto & f : futures)
+        f.wait();
+
+    for (auto & f : futures)
+        sources.push_back(f.get());
+
+    for (auto & source : sources)
+        source->flush_errors();
+
+    return sources;
+}
+
+// Compares each version with the next one, and the first with the last.
+// Every version is loaded once and shared by the pairs it is part of,
+// together with the structural fingerprints computed for it. Returns the
+// exit status.
+static
+int compare_versions(const string & file_path, const string & type_name, const vector<string> & roots,
+                     Comparison::Options options, const Source::Options & source_options,
+                     bool parallel_load, Comparison::Sink & out)
+{
+    vector<unique_ptr<Source>> sources;
+    {
+        Stats::Phase phase(options.stats, "load");
+        sources = load_versions(file_path, roots, source_options, parallel_load);
+    }
+    Stats::Phase phase(options.stats, "compare");
+
+    vector<pair<size_t, size_t>> pairs;
+    for (size_t i = 0; i + 1 < roots.size(); ++i)
+        pairs.emplace_back(i, i + 1);
+    if (roots.size() > 2)
+        pairs.emplace_back(0, roots.size() - 1);
+
+    if (!options.fail_fast)
+        out.begin_section(Comparison::Root_Section, "", "");
+
+    for (auto & versions : pairs)
+    {
+        auto & root1 = roots[versions.first];
+        auto & root2 = roots[versions.second];
+        auto & source1 = *sources[versions.first];
+        auto & source2 = *sources[versions.second];
+
+        VersionSink sink(out, root1, root2);
+        options.sink = &sink;
+
+        Comparison comparison(options);
+        if (type_name == ".")
+            comparison.compare(source1, source2);
+        else
+            comparison.compare(source1, type_name, source2, type_name);
+
+        if (options.fail_fast && comparison.first_breaking())
+        {
+            cout << "Breaking change from " << root1 << " to " << root2 << ": "
+                 << comparison.first_breaking()->message() << endl;
+            return 2;
+        }
+    }
+
+    if (!options.fail_fast)
+        out.end_section();
+
+    return 0;
+}
+
+// The text of a report in blocks that can be matched up between runs: one
+// per item of the root and one per top-level section, keyed by their first
+// line, in the order of the report.
+class ReportBlocks : public Comparison::Sink
+{
+public:
+    void begin_section(Comparison::SectionType type, string_view a, string_view b) override
+    {
+        if (depth > 0)
+        {
+            string line = text(Comparison::label(type), a, b);
+            if (depth == 1)
+                start(line);
+            add(line);
+        }
+        ++depth;
+    }
+
+    void note(string_view a, string_view b) override
+    {
+        add(text("Required by", a, b, " "));
+    }
+
+    void item(Comparison::ItemType type, string_view a, string_view b) override
+    {
+        string line = "* " + text(Comparison::label(type), a, b);
+        if (depth == 1)
+            start(line);
+        add(line);
+    }
+
+    void end_section() override { --depth; }
+
+    // Key and text of each block.
+    vector<pair<string, string>> blocks;
+
+    // The text of the block with 'key', or null if there is none.
+    const string * find(const string & key) const
+    {
+        auto it = keys.find(key);
+        return it == keys.end() ? nullptr : &blocks[it->second].second;
+    }
+
+private:
+    static string text(const char * label, string_view a, string_view b, const char * separator = ": ")
+    {
+        if (!label)
+            return "?";
+        return string(label) + separator + string(a) + " -> " + string(b);
+    }
+
+    void start(const string & key)
+    {
+        keys[key] = blocks.size();
+        blocks.emplace_back(key, string());
+    }
+
+    void add(const string & line)
+    {
+        blocks.back().second += string(size_t(depth - 1) * 2, ' ') + line + '\n';
+    }
+
+    int depth = 0;
+    std::map<string, size_t> keys;
+};
+
+// Writes the blocks that are new or different in 'after', and the first line
+// of those gone from it. Returns whether there were any.
+static
+bool write_delta(const ReportBlocks & before, const ReportBlocks & after, OutputBuffer & out)
+{
+    bool any = false;
+    for (auto & block : after.blocks)
+    {
+        auto * text = before.find(block.first);
+        if (!text || *text != block.second)
+        {
+            out.write(block.second);
+            any = true;
+        }
+    }
+
+    for (auto & block : before.blocks)
+    {
+        if (!after.find(block.first))
+        {
+            any = true;
+            out.write("Resolved: ");
+            out.write(block.first);
+            out.write('\n');
+        }
+    }
+    return any;
+}
+
+// Compares again whenever one of the files that file2 is built from changes
+// below root2, and writes only what changed in the report. The baseline is
+// loaded once, along with its fingerprints; on the candidate side only the
+// changed files are parsed again. Runs until the process is ended.
+static
+void watch(char * argv[], const Comparison::Options & options, Source::Options source_options)
+{
+    DirectoryWatcher watcher(argv[3]);
+
+    Source source1(argv[2], argv[1], source_options);
+
+    ParseMemo memo;
+    source_options.memo = &memo;
+    unique_ptr<Source> source2;
+
+    string type_name = argv[5];
+    unique_ptr<ReportBlocks> blocks(new ReportBlocks);
+    OutputBuffer out;
+
+    while (true)
+    {
+        source2.reset();
+        try
+        {
+            source2.reset(new Source(argv[4], argv[3], source_options));
+
+            unique_ptr<ReportBlocks> report(new ReportBlocks);
+            Comparison::Options watch_options = options;
+            watch_options.sink = report.get();
+
+            Comparison comparison(watch_options);
+            if (type_name == ".")
+                comparison.compare(source1, *source2);
+            else
+                comparison.compare(source1, type_name, *source2, type_name);
+
+            if (!write_delta(*blocks, *report, out))
+                out.write("No change to the report.\n");
+            blocks = std::move(report);
+        }
+        catch (std::exception & e)
+        {
+            out.flush();
+            cerr << e.what() << endl;
+        }
+        out.flush();
+
+        // After a failed load, any change may be the fix.
+        while (true)
+        {
+            auto changed = watcher.wait();
+            bool relevant = !source2;
+            for (auto & path : changed)
+                relevant = relevant || source2->file_hashes().count(path);
+            if (!relevant)
+                continue;
+
+            out.write("Changed:");
+            for (auto & path : changed)
+            {
+                out.write(' ');
+                out.write(path);
+            }
+            out.write('\n');
+            out.flush();
+            break;
+        }
+    }
+}
+
+// Compares like the default mode, first counting the field numbers in a
+// corpus of messages of 'type_name', so that removed and renumbered fields
+// can be reported with how often they occur.
+static
+void compare_with_census(const string & corpus_path, Source & source1, Source & source2, const string & type_name,
+                         Comparison::Options options, Comparison::Sink & out)
+{
+    auto * type = source1.pool()->FindMessageTypeByName(type_name);
+    if (!type)
+        throw std::runtime_error("Message type not found: " + type_name);
+
+    FieldCensus::Options census_options;
+    census_options.jobs = options.jobs;
+    FieldCensus census(type, census_options);
+    {
+        Stats::Phase phase(options.stats, "census");
+        census.run(corpus_path);
+    }
+
+    CensusSink sink(out, census, source1.pool(), options.binary);
+    options.sink = &sink;
+
+    Stats::Phase phase(options.stats, "compare");
+    Comparison comparison(options);
+    comparison.compare(source1, type_name, source2, type_name);
+}
+
 int main(int argc, char * argv[])
 {
-    if (argc < 6)
+#ifndef _WIN32
+    // A git process that exits early shows up as a read error rather than killing us.
+    signal(SIGPIPE, SIG_IGN);
+#endif
+
+    // With --directories, all .proto files of two trees are compared, matched by relative path.
+    bool directories = argc > 1 && string(argv[1]) == "--directories";
+    int first_option = directories ? 4 : 6;
+
+    // With --versions, one file is compared across a list of roots, up to the first option.
+    bool versions = argc > 1 && string(argv[1]) == "--versions";
+    vector<string> version_roots;
+    if (versions)
+    {
+        first_option = 4;
+        while (first_option < argc && string(argv[first_option]).compare(0, 2, "--") != 0)
+            version_roots.push_back(argv[first_option++]);
+        if (version_roots.size() < 2)
+            first_option = argc + 1;
+    }
+
+    // With --serve, comparisons are run on request from a Unix domain socket.
+    bool serve = argc > 1 && string(argv[1]) == "--serve";
+    if (serve)
+        first_option = 3;
+
+    // With --replay, a corpus of messages of one type is decoded with both versions.
+    bool replay = argc > 1 && string(argv[1]) == "--replay";
+    if (replay)
+        first_option = 8;
+
+    if (argc < first_option)
     {
-        cerr << "Expected arguments: root-dir1 file1 root-dir2 file2 type [--binary]" << endl;
+        cerr << "Expected arguments: root1 file1 root2 file2 type [--binary] [--parallel-load] [--descriptor-sets] [--mmap] [--cache-dir <dir>] [--share-imports] [--jobs <n>] [--fail-fast] [--format=<text|json|ndjson>] [--census <corpus>] [--watch] [--stats[=json]] [--trace=<file>]" << endl;
+        cerr << "                or: --directories dir1 dir2 [options]" << endl;
+        cerr << "                or: --versions file type root1 root2 ... [options]" << endl;
+        cerr << "                or: --serve socket [options]" << endl;
+        cerr << "                or: --replay corpus root1 file1 root2 file2 type [options]" << endl;
         cerr << "Use '.' for <type> to compare all messages and enums in given files." << endl;
+        cerr << "A root is a directory of .proto files, or a FileDescriptorSet (.pb, .binpb, .desc, .protoset)." << endl;
         return 1;
     }
 
     Comparison::Options options;
+    Source::Options source_options;
+    bool parallel_load = false;
+    bool share_imports = false;
+    bool watching = false;
+    string census_path;
+    string format = "text";
+    string stats_format;
+    string trace_path;
 
-    if (argc > 6)
+    if (argc > first_option)
     {
-        for (int i = 6; i < argc; ++i)
+        for (int i = first_option; i < argc; ++i)
         {
             string arg = argv[i];
             if (arg == "--binary")
             {
                 options.binary = true;
             }
+            else if (arg == "--parallel-load")
+            {
+                parallel_load = true;
+            }
+            else if (arg == "--descriptor-sets")
+            {
+                source_options.descriptor_set = true;
+            }
+            else if (arg == "--mmap")
+            {
+                source_options.mapped = true;
+            }
+            else if (arg == "--share-imports")
+            {
+                share_imports = true;
+            }
+            else if (arg == "--jobs" && i + 1 < argc)
+            {
+                int jobs = atoi(argv[++i]);
+                if (jobs < 1)
+                {
+                    cerr << "Invalid number of jobs: " << argv[i] << endl;
+                    return 1;
+                }
+                options.jobs = unsigned(jobs);
+            }
+            else if (arg == "--fail-fast")
+            {
+                options.fail_fast = true;
+            }
+            else if (arg.compare(0, 9, "--format=") == 0)
+            {
+                format = arg.substr(9);
+            }
+            else if (arg == "--format" && i + 1 < argc)
+            {
+                format = argv[++i];
+            }
+            else if (arg == "--census" && i + 1 < argc)
+            {
+                census_path = argv[++i];
+            }
+            else if (arg == "--watch")
+            {
+                watching = true;
+            }
+            else if (arg == "--stats")
+            {
+                stats_format = "text";
+            }
+            else if (arg.compare(0, 8, "--stats=") == 0)
+            {
+                stats_format = arg.substr(8);
+                if (stats_format != "text" && stats_format != "json")
+                {
+                    cerr << "Unknown stats format: " << stats_format << endl;
+                    return 1;
+                }
+            }
+            else if (arg.compare(0, 8, "--trace=") == 0)
+            {
+                trace_path = arg.substr(8);
+            }
+            else if (arg == "--trace" && i + 1 < argc)
+            {
+                trace_path = argv[++i];
+            }
+            else if (arg == "--cache-dir" && i + 1 < argc)
+            {
+                source_options.cache_dir = argv[++i];
+            }
             else
             {
                 cerr << "Unknown option: " << arg << endl;
@@ -32,27 +567,209 @@ int main(int argc, char * argv[])
         }
     }
 
+    if (share_imports && (parallel_load || !source_options.cache_dir.empty()))
+    {
+        cerr << "--share-imports can't be combined with --parallel-load or --cache-dir." << endl;
+        return 1;
+    }
+
+    if ((!stats_format.empty() || !trace_path.empty()) && (serve || replay || watching))
+    {
+        cerr << "--stats and --trace only work with a single comparison." << endl;
+        return 1;
+    }
+
+    if (serve)
+    {
+        Server::Options server_options;
+        server_options.source = source_options;
+        server_options.jobs = options.jobs;
+        try
+        {
+            Server(argv[2], server_options).run();
+        }
+        catch(std::exception & e)
+        {
+            cerr << e.what() << endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    if (replay)
+    {
+        unique_ptr<Source> replay_source1;
+        unique_ptr<Source> replay_source2;
+        try
+        {
+            load_sources(replay_source1, replay_source2, argv + 2, source_options, parallel_load, share_imports);
+
+            string type_name = argv[7];
+            auto * type1 = replay_source1->pool()->FindMessageTypeByName(type_name);
+            auto * type2 = replay_source2->pool()->FindMessageTypeByName(type_name);
+            if (!type1 || !type2)
+                throw std::runtime_error("Message type not found: " + type_name);
+
+            Replay::Options replay_options;
+            replay_options.jobs = options.jobs;
+            Replay corpus_replay(type1, type2, replay_options);
+            corpus_replay.run(argv[2]);
+
+            OutputBuffer out;
+            corpus_replay.print(out);
+            out.flush();
+            return corpus_replay.affected() ? 2 : 0;
+        }
+        catch(std::exception & e)
+        {
+            cerr << e.what() << endl;
+            return 1;
+        }
+    }
+
+    if (watching)
+    {
+        if (directories || versions || serve || replay || options.fail_fast || format != "text")
+        {
+            cerr << "--watch only works with root1 file1 root2 file2 type and the text format." << endl;
+            return 1;
+        }
+
+        try
+        {
+            watch(argv, options, source_options);
+        }
+        catch(std::exception & e)
+        {
+            cerr << e.what() << endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    // The report goes straight to stdout as it is produced.
+    OutputBuffer out;
+    unique_ptr<Comparison::Sink> writer;
+    if (format == "text")
+        writer.reset(new TextWriter(out));
+    else if (format == "json")
+        writer.reset(new JsonWriter(out));
+    else if (format == "ndjson")
+        writer.reset(new NdjsonWriter(out));
+    else
+    {
+        cerr << "Unknown format: " << format << endl;
+        return 1;
+    }
+
+    if (!census_path.empty() && (directories || versions || options.fail_fast || string(argv[5]) == "."))
+    {
+        cerr << "--census needs root1 file1 root2 file2 with the corpus's message type, and no --fail-fast." << endl;
+        return 1;
+    }
+
+    // Counters and timings go to stderr at the end, so they don't mix with the report.
+    Stats stats;
+    if (!stats_format.empty())
+        options.stats = &stats;
+
+    // Trace events are kept in memory and written out when the run is done.
+    Trace trace;
+    if (!trace_path.empty())
+    {
+        options.trace = &trace;
+        source_options.trace = &trace;
+    }
+
+    auto write_diagnostics = [&]()
+    {
+        if (stats_format == "json")
+            stats.write_json(cerr);
+        else if (!stats_format.empty())
+            stats.write_text(cerr);
+
+        if (trace_path.empty())
+            return;
+        ofstream file(trace_path, ios::binary);
+        trace.write(file);
+        file.close();
+        if (!file)
+            cerr << "Failed to write trace: " << trace_path << endl;
+    };
+
+    CountingSink counting(*writer, stats);
+    Comparison::Sink & report = options.stats ? counting : *writer;
+
+    if (!options.fail_fast)
+        options.sink = &report;
+
     Comparison comparison(options);
+    // The report refers to names in the sources' descriptor pools.
+    unique_ptr<Source> source1;
+    unique_ptr<Source> source2;
+
+    int status = 0;
 
     try
     {
-        Source source1(argv[2], argv[1]);
-        Source source2(argv[4], argv[3]);
-        string message_name = argv[5];
-        if (message_name == ".")
-            comparison.compare(source1, source2);
+        if (versions)
+        {
+            status = compare_versions(argv[2], argv[3], version_roots, options, source_options, parallel_load, report);
+        }
+        else if (directories)
+        {
+            {
+                Stats::Phase phase(options.stats, "load");
+                load_directories(source1, source2, argv[2], argv[3], source_options, parallel_load);
+            }
+            Stats::Phase phase(options.stats, "compare");
+            comparison.compare_files(*source1, *source2);
+        }
+        else if (!census_path.empty())
+        {
+            {
+                Stats::Phase phase(options.stats, "load");
+                load_sources(source1, source2, argv, source_options, parallel_load, share_imports);
+            }
+            compare_with_census(census_path, *source1, *source2, argv[5], options, report);
+        }
         else
-            comparison.compare(source1, message_name, source2, message_name);
+        {
+            {
+                Stats::Phase phase(options.stats, "load");
+                load_sources(source1, source2, argv, source_options, parallel_load, share_imports);
+            }
+            Stats::Phase phase(options.stats, "compare");
+            string message_name = argv[5];
+            if (message_name == ".")
+                comparison.compare(*source1, *source2);
+            else
+                comparison.compare(*source1, message_name, *source2, message_name);
+        }
     }
     catch(std::exception & e)
     {
+        out.flush();
         cerr << e.what() << endl;
         return 1;
     }
 
-    comparison.root.trim();
-    comparison.root.print();
+    if (options.fail_fast && !versions)
+    {
+        write_diagnostics();
+        // Exit status 2 tells a breaking change apart from errors (1).
+        auto * item = comparison.first_breaking();
+        if (!item)
+            return 0;
+        cout << "Breaking change: " << item->message() << endl;
+        return 2;
+    }
 
-    return 0;
-}
+    {
+        Stats::Phase phase(options.stats, "write");
+        out.flush();
+    }
+    write_diagnostics();
 
+    return status;
+}
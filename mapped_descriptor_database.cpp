@@ -0,0 +1,365 @@
+#include "mapped_descriptor_database.h"
+
+#include <google/protobuf/descriptor.pb.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#include <fstream>
+#endif
+
+using namespace std;
+
+using google::protobuf::FileDescriptorProto;
+
+MappedFile::~MappedFile()
+{
+#ifndef _WIN32
+    if (d_mapped)
+        munmap(const_cast<uint8_t*>(d_data), d_size);
+#endif
+}
+
+bool MappedFile::open(const string & path)
+{
+#ifndef _WIN32
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat info;
+    if (fstat(fd, &info) != 0)
+    {
+        ::close(fd);
+        return false;
+    }
+
+    d_size = info.st_size;
+    if (d_size == 0)
+    {
+        ::close(fd);
+        d_data = d_buffer.data();
+        return true;
+    }
+
+    void * address = mmap(nullptr, d_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (address == MAP_FAILED)
+        return false;
+
+    d_data = static_cast<const uint8_t*>(address);
+    d_mapped = true;
+    return true;
+#else
+    ifstream input(path, ios::binary);
+    if (!input.is_open())
+        return false;
+
+    d_buffer.assign(istreambuf_iterator<char>(input), istreambuf_iterator<char>());
+    d_data = d_buffer.data();
+    d_size = d_buffer.size();
+    return true;
+#endif
+}
+
+namespace {
+
+// Minimal wire format reader, enough to walk the outer levels of a
+// FileDescriptorSet without decoding any message.
+struct WireReader
+{
+    const uint8_t * pos;
+    const uint8_t * end;
+
+    bool at_end() const { return pos == end; }
+
+    bool varint(uint64_t & value)
+    {
+        value = 0;
+        for (int shift = 0; shift < 64 && pos != end; shift += 7)
+        {
+            uint8_t byte = *pos++;
+            value |= uint64_t(byte & 0x7f) << shift;
+            if (!(byte & 0x80))
+                return true;
+        }
+        return false;
+    }
+
+    // Reads the next tag and, for length-delimited fields, the payload.
+    // Other fields are skipped and reported with an empty payload.
+    bool field(uint32_t & number, const uint8_t *& payload, size_t & size)
+    {
+        uint64_t tag;
+        if (!varint(tag))
+            return false;
+
+        number = uint32_t(tag >> 3);
+        payload = nullptr;
+        size = 0;
+
+        switch (tag & 7)
+        {
+        case 0:
+        {
+            uint64_t ignored;
+            return varint(ignored);
+        }
+        case 1:
+            return skip(8);
+        case 2:
+        {
+            uint64_t length;
+            if (!varint(length) || length > uint64_t(end - pos))
+                return false;
+            payload = pos;
+            size = length;
+            pos += length;
+            return true;
+        }
+        case 5:
+            return skip(4);
+        default:
+            return false;
+        }
+    }
+
+    bool skip(size_t count)
+    {
+        if (count > size_t(end - pos))
+            return false;
+        pos += count;
+        return true;
+    }
+};
+
+// Finds the first occurrence of string field 'wanted' in a message.
+bool find_string(const uint8_t * data, size_t size, uint32_t wanted, string & value)
+{
+    WireReader reader { data, data + size };
+    while (!reader.at_end())
+    {
+        uint32_t number;
+        const uint8_t * payload;
+        size_t length;
+        if (!reader.field(number, payload, length))
+            return false;
+        if (number == wanted && payload)
+        {
+            value.assign(reinterpret_cast<const char*>(payload), length);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Finds the first occurrence of varint field 'wanted' in a message.
+bool find_varint(const uint8_t * data, size_t size, uint32_t wanted, uint64_t & value)
+{
+    WireReader reader { data, data + size };
+    while (!reader.at_end())
+    {
+        const uint8_t * field_start = reader.pos;
+        uint64_t tag;
+        if (!reader.varint(tag))
+            return false;
+        if ((tag >> 3) == wanted && (tag & 7) == 0)
+            return reader.varint(value);
+
+        reader.pos = field_start;
+        uint32_t number;
+        const uint8_t * payload;
+        size_t length;
+        if (!reader.field(number, payload, length))
+            return false;
+    }
+    return false;
+}
+
+// Field numbers from descriptor.proto.
+enum
+{
+    FileSet_File = 1,
+    File_Name = 1,
+    File_Package = 2,
+    File_MessageType = 4,
+    File_EnumType = 5,
+    File_Service = 6,
+    File_Extension = 7,
+    Element_Name = 1,
+    Field_Extendee = 2,
+    Field_Number = 3
+};
+
+}
+
+bool MappedDescriptorDatabase::open(const string & path, string * error)
+{
+    if (!file.open(path))
+    {
+        *error = "File not found.";
+        return false;
+    }
+
+    WireReader reader { file.data(), file.data() + file.size() };
+    while (!reader.at_end())
+    {
+        uint32_t number;
+        const uint8_t * payload;
+        size_t size;
+        if (!reader.field(number, payload, size))
+        {
+            *error = "Not a valid FileDescriptorSet.";
+            return false;
+        }
+
+        if (number != FileSet_File || !payload)
+            continue;
+
+        if (!index_file(payload, size, error))
+            return false;
+    }
+
+    return true;
+}
+
+bool MappedDescriptorDatabase::index_file(const uint8_t * data, size_t size, string * error)
+{
+    size_t file_index = files.size();
+    FileEntry entry { data, size, string() };
+    string package;
+
+    // Symbols are collected first, since the package may follow them.
+    vector<pair<const uint8_t*, size_t>> symbols;
+    vector<pair<const uint8_t*, size_t>> extensions;
+
+    WireReader reader { data, data + size };
+    while (!reader.at_end())
+    {
+        uint32_t number;
+        const uint8_t * payload;
+        size_t length;
+        if (!reader.field(number, payload, length))
+        {
+            *error = "Not a valid FileDescriptorSet.";
+            return false;
+        }
+        if (!payload)
+            continue;
+
+        switch (number)
+        {
+        case File_Name:
+            entry.name.assign(reinterpret_cast<const char*>(payload), length);
+            break;
+        case File_Package:
+            package.assign(reinterpret_cast<const char*>(payload), length);
+            break;
+        case File_MessageType:
+        case File_EnumType:
+        case File_Service:
+            symbols.emplace_back(payload, length);
+            break;
+        case File_Extension:
+            extensions.emplace_back(payload, length);
+            break;
+        default:
+            break;
+        }
+    }
+
+    // Rejected like a set loaded without --mmap, rather than picking one of the two.
+    if (!files_by_name.emplace(entry.name, file_index).second)
+    {
+        *error = "Duplicate file in descriptor set: " + entry.name;
+        return false;
+    }
+
+    string prefix = package.empty() ? string() : package + ".";
+
+    for (auto & symbol : symbols)
+    {
+        string name;
+        if (find_string(symbol.first, symbol.second, Element_Name, name))
+            files_by_symbol.emplace(prefix + name, file_index);
+    }
+
+    for (auto & extension : extensions)
+    {
+        string name;
+        if (find_string(extension.first, extension.second, Element_Name, name))
+            files_by_symbol.emplace(prefix + name, file_index);
+
+        string extendee;
+        uint64_t field_number;
+        if (find_string(extension.first, extension.second, Field_Extendee, extendee) &&
+                find_varint(extension.first, extension.second, Field_Number, field_number))
+        {
+            if (!extendee.empty() && extendee[0] == '.')
+                extendee.erase(0, 1);
+            files_by_extension.emplace(make_pair(extendee, int(field_number)), file_index);
+        }
+    }
+
+    files.push_back(std::move(entry));
+    return true;
+}
+
+bool MappedDescriptorDatabase::decode(size_t file_index, FileDescriptorProto * output) const
+{
+    const FileEntry & entry = files[file_index];
+    return output->ParseFromArray(entry.data, int(entry.size));
+}
+
+bool MappedDescriptorDatabase::FindFileByName(const string & filename, FileDescriptorProto * output)
+{
+    auto it = files_by_name.find(filename);
+    if (it == files_by_name.end())
+        return false;
+    return decode(it->second, output);
+}
+
+bool MappedDescriptorDatabase::FindFileContainingSymbol(const string & symbol_name, FileDescriptorProto * output)
+{
+    // Nested types, fields and values are not indexed; walk up to the
+    // enclosing top-level symbol instead.
+    string name = symbol_name;
+    while (true)
+    {
+        auto it = files_by_symbol.find(name);
+        if (it != files_by_symbol.end())
+            return decode(it->second, output);
+
+        auto dot = name.rfind('.');
+        if (dot == string::npos)
+            return false;
+        name.resize(dot);
+    }
+}
+
+bool MappedDescriptorDatabase::FindFileContainingExtension(const string & containing_type, int field_number,
+                                                           FileDescriptorProto * output)
+{
+    auto it = files_by_extension.find(make_pair(containing_type, field_number));
+    if (it == files_by_extension.end())
+        return false;
+    return decode(it->second, output);
+}
+
+bool MappedDescriptorDatabase::FindAllExtensionNumbers(const string & extendee_type, vector<int> * output)
+{
+    auto it = files_by_extension.lower_bound(make_pair(extendee_type, 0));
+    for (; it != files_by_extension.end() && it->first.first == extendee_type; ++it)
+        output->push_back(it->first.second);
+    return true;
+}
+
+bool MappedDescriptorDatabase::FindAllFileNames(vector<string> * output)
+{
+    for (auto & entry : files)
+        output->push_back(entry.name);
+    return true;
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <google/protobuf/descriptor_database.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Read-only view of a whole file, memory mapped where the platform allows it.
+class MappedFile
+{
+public:
+    MappedFile() {}
+    ~MappedFile();
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile & operator=(const MappedFile &) = delete;
+
+    bool open(const std::string & path);
+
+    const uint8_t * data() const { return d_data; }
+    size_t size() const { return d_size; }
+
+private:
+    const uint8_t * d_data = nullptr;
+    size_t d_size = 0;
+    bool d_mapped = false;
+    std::vector<uint8_t> d_buffer;
+};
+
+// A DescriptorDatabase over a serialized FileDescriptorSet that is never
+// parsed as a whole. Opening the file only records where each
+// FileDescriptorProto starts, along with its name and the names of its
+// top-level symbols and extensions. A FileDescriptorProto is decoded when
+// a DescriptorPool first asks for it, so the cost follows the part of the
+// schema that is actually used rather than the size of the set.
+class MappedDescriptorDatabase : public google::protobuf::DescriptorDatabase
+{
+    using FileDescriptorProto = google::protobuf::FileDescriptorProto;
+
+public:
+    MappedDescriptorDatabase() {}
+
+    // Maps and indexes 'path'. On failure, returns false with a reason in 'error'.
+    bool open(const std::string & path, std::string * error);
+
+    bool FindFileByName(const std::string & filename, FileDescriptorProto * output) override;
+    bool FindFileContainingSymbol(const std::string & symbol_name, FileDescriptorProto * output) override;
+    bool FindFileContainingExtension(const std::string & containing_type, int field_number,
+                                     FileDescriptorProto * output) override;
+    bool FindAllExtensionNumbers(const std::string & extendee_type, std::vector<int> * output) override;
+    bool FindAllFileNames(std::vector<std::string> * output) override;
+
+private:
+    struct FileEntry
+    {
+        const uint8_t * data;
+        size_t size;
+        std::string name;
+    };
+
+    // Returns false with a reason in 'error' if the file is malformed or its name is taken.
+    bool index_file(const uint8_t * data, size_t size, std::string * error);
+    bool decode(size_t file_index, FileDescriptorProto * output) const;
+
+    MappedFile file;
+    std::vector<FileEntry> files;
+    std::unordered_map<std::string, size_t> files_by_name;
+    // Fully qualified top-level symbols. Ordered, so nested names can be
+    // resolved to their closest enclosing top-level symbol.
+    std::map<std::string, size_t> files_by_symbol;
+    std::map<std::pair<std::string, int>, size_t> files_by_extension;
+};
@@ -0,0 +1,153 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+// A flat, open-addressing hash map keyed by a pair of pointers.
+//
+// Used to memoize comparisons of descriptor pairs: a lookup needs no key
+// allocation, and find_or_insert() does the lookup and the insertion
+// with a single probe sequence. clear() keeps the table's storage, so the
+// map can be reused for another comparison without reallocating.
+template <typename Value>
+class PairMap
+{
+public:
+    PairMap() {}
+
+    // Returns the value for (a, b) and whether it was just inserted,
+    // in which case it is value-initialized.
+    std::pair<Value*, bool> find_or_insert(const void * a, const void * b)
+    {
+        if ((count + 1) * 2 > slots.size())
+            grow();
+
+        size_t index = find_slot(slots, a, b);
+        Slot & slot = slots[index];
+        if (slot.a)
+            return { &slot.value, false };
+
+        slot.a = a;
+        slot.b = b;
+        slot.value = Value();
+        ++count;
+        return { &slot.value, true };
+    }
+
+    // Returns the value for (a, b), or null if there is none.
+    Value * find(const void * a, const void * b)
+    {
+        if (slots.empty())
+            return nullptr;
+
+        Slot & slot = slots[find_slot(slots, a, b)];
+        return slot.a ? &slot.value : nullptr;
+    }
+
+    size_t size() const { return count; }
+
+    void clear()
+    {
+        for (auto & slot : slots)
+            slot = Slot();
+        count = 0;
+    }
+
+    static size_t hash(const void * a, const void * b)
+    {
+        uint64_t value = reinterpret_cast<uintptr_t>(a) * 0x9e3779b97f4a7c15ull;
+        value ^= reinterpret_cast<uintptr_t>(b) + 0x7f4a7c159e3779b9ull + (value << 6) + (value >> 2);
+        value ^= value >> 29;
+        return size_t(value);
+    }
+
+private:
+    struct Slot
+    {
+        const void * a = nullptr;
+        const void * b = nullptr;
+        Value value = Value();
+    };
+
+    // Index of the slot holding (a, b), or of the empty slot where it would go.
+    static size_t find_slot(const std::vector<Slot> & table, const void * a, const void * b)
+    {
+        size_t mask = table.size() - 1;
+        size_t index = hash(a, b) & mask;
+        while (table[index].a && (table[index].a != a || table[index].b != b))
+            index = (index + 1) & mask;
+        return index;
+    }
+
+    void grow()
+    {
+        std::vector<Slot> larger(slots.empty() ? 64 : slots.size() * 2);
+        for (auto & slot : slots)
+        {
+            if (slot.a)
+                larger[find_slot(larger, slot.a, slot.b)] = std::move(slot);
+        }
+        slots.swap(larger);
+    }
+
+    std::vector<Slot> slots;
+    size_t count = 0;
+};
+
+// A PairMap split into independently locked shards, for use from several
+// threads. Values are copied out under the lock, so they should be cheap
+// to copy, such as pointers to objects that live elsewhere.
+template <typename Value>
+class ConcurrentPairMap
+{
+public:
+    ConcurrentPairMap() {}
+
+    // Returns the value for (a, b) and whether it was just inserted, in
+    // which case it was produced by 'make'. Only one caller gets to insert.
+    template <typename Make>
+    std::pair<Value, bool> find_or_insert(const void * a, const void * b, Make make)
+    {
+        Shard & shard = shards[(PairMap<Value>::hash(a, b) >> 16) % shard_count];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+
+        auto found = shard.map.find_or_insert(a, b);
+        if (found.second)
+            *found.first = make();
+        return { *found.first, found.second };
+    }
+
+    size_t size()
+    {
+        size_t count = 0;
+        for (auto & shard : shards)
+        {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            count += shard.map.size();
+        }
+        return count;
+    }
+
+    void clear()
+    {
+        for (auto & shard : shards)
+        {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            shard.map.clear();
+        }
+    }
+
+private:
+    static const size_t shard_count = 32;
+
+    struct Shard
+    {
+        std::mutex mutex;
+        PairMap<Value> map;
+    };
+
+    Shard shards[shard_count];
+};
@@ -0,0 +1,141 @@
+#include "parse_cache.h"
+#include "source.h"
+
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <unordered_set>
+#include <vector>
+
+using namespace std;
+
+using google::protobuf::FileDescriptor;
+using google::protobuf::FileDescriptorProto;
+using google::protobuf::FileDescriptorSet;
+using google::protobuf::compiler::SourceTree;
+
+static const char * const cache_header = "protobuf-format-diff parse cache 1";
+
+static
+string to_hex(uint64_t value)
+{
+    char text[17];
+    snprintf(text, sizeof(text), "%016llx", static_cast<unsigned long long>(value));
+    return text;
+}
+
+uint64_t ParseCache::hash(const string & data, uint64_t seed)
+{
+    // 64-bit FNV-1a: stable across platforms and runs, which std::hash is not.
+    uint64_t value = seed;
+    for (unsigned char c : data)
+    {
+        value ^= c;
+        value *= 1099511628211ull;
+    }
+    return value;
+}
+
+string ParseCache::entry_path(const string & root_dir, const string & file_path) const
+{
+    uint64_t key = hash(root_dir);
+    key = hash(string(1, '\0'), key);
+    key = hash(file_path, key);
+    return (filesystem::path(directory) / (to_hex(key) + ".pbcache")).string();
+}
+
+// An entry is a text manifest, one "<hash> <path>" line per file in the
+// closure, followed by an empty line and the binary FileDescriptorSet.
+bool ParseCache::load(const string & root_dir, const string & file_path,
+                      SourceTree & tree, FileDescriptorSet * file_set) const
+{
+    ifstream input(entry_path(root_dir, file_path), ios::binary);
+    if (!input.is_open())
+        return false;
+
+    string line;
+    if (!getline(input, line) || line != cache_header)
+        return false;
+
+    if (!getline(input, line) || line != root_dir + "/" + file_path)
+        return false;
+
+    while (getline(input, line) && !line.empty())
+    {
+        auto space = line.find(' ');
+        if (space == string::npos)
+            return false;
+
+        string contents;
+        if (!read_source_file(tree, line.substr(space + 1), &contents))
+            return false;
+
+        if (to_hex(hash(contents)) != line.substr(0, space))
+            return false;
+    }
+
+    return file_set->ParseFromIstream(&input) && file_set->file_size() > 0;
+}
+
+void ParseCache::store(const string & root_dir, const string & file_path,
+                       SourceTree & tree, const FileDescriptor * file) const
+{
+    // Dependencies come before the files that import them.
+    vector<const FileDescriptor*> closure;
+    unordered_set<const FileDescriptor*> seen;
+    vector<pair<const FileDescriptor*, int>> stack { { file, 0 } };
+    seen.insert(file);
+    while (!stack.empty())
+    {
+        auto & top = stack.back();
+        if (top.second < top.first->dependency_count())
+        {
+            auto * dependency = top.first->dependency(top.second++);
+            if (seen.insert(dependency).second)
+                stack.emplace_back(dependency, 0);
+            continue;
+        }
+        closure.push_back(top.first);
+        stack.pop_back();
+    }
+
+    ostringstream manifest;
+    manifest << cache_header << '\n' << root_dir << "/" << file_path << '\n';
+
+    FileDescriptorSet file_set;
+    for (auto * member : closure)
+    {
+        string contents;
+        if (!read_source_file(tree, member->name(), &contents))
+            return;
+
+        manifest << to_hex(hash(contents)) << ' ' << member->name() << '\n';
+        member->CopyTo(file_set.add_file());
+    }
+    manifest << '\n';
+
+    error_code error;
+    filesystem::create_directories(directory, error);
+
+    string path = entry_path(root_dir, file_path);
+    string temp_path = path + "." + to_hex(random_device{}()) + ".tmp";
+    {
+        ofstream output(temp_path, ios::binary | ios::trunc);
+        if (!output.is_open())
+            return;
+
+        output << manifest.str();
+        if (!file_set.SerializeToOstream(&output))
+        {
+            output.close();
+            filesystem::remove(temp_path, error);
+            return;
+        }
+    }
+
+    filesystem::rename(temp_path, path, error);
+    if (error)
+        filesystem::remove(temp_path, error);
+}
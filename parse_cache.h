@@ -0,0 +1,44 @@
+#pragma once
+
+#include <google/protobuf/compiler/importer.h>
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/descriptor.pb.h>
+
+#include <cstdint>
+#include <string>
+
+// An on-disk cache of imported .proto files.
+//
+// After a successful import, store() writes every file in the import
+// closure as a FileDescriptorProto, together with a hash of each file's
+// contents. load() gives back that FileDescriptorSet as long as every
+// recorded file still hashes the same, so an unchanged schema is
+// rebuilt without running the parser at all.
+//
+// Entries are keyed by root directory and file path, so each import
+// mapping gets its own entry. An entry is replaced with a single rename,
+// which lets concurrent runs share a cache directory.
+class ParseCache
+{
+    using SourceTree = google::protobuf::compiler::SourceTree;
+    using FileDescriptor = google::protobuf::FileDescriptor;
+    using FileDescriptorSet = google::protobuf::FileDescriptorSet;
+
+public:
+    explicit ParseCache(const std::string & directory): directory(directory) {}
+
+    // Fills 'file_set' from the cache if the entry exists and all of its files are unchanged in 'tree'.
+    bool load(const std::string & root_dir, const std::string & file_path,
+              SourceTree & tree, FileDescriptorSet * file_set) const;
+
+    // Records 'file' and everything it imports. Failures are not reported; the cache is best-effort.
+    void store(const std::string & root_dir, const std::string & file_path,
+               SourceTree & tree, const FileDescriptor * file) const;
+
+    static uint64_t hash(const std::string & data, uint64_t seed = 14695981039346656037ull);
+
+private:
+    std::string entry_path(const std::string & root_dir, const std::string & file_path) const;
+
+    std::string directory;
+};
@@ -0,0 +1,291 @@
+#include "replay.h"
+#include "corpus.h"
+#include "report_writer.h"
+
+#include <google/protobuf/dynamic_message.h>
+#include <google/protobuf/message.h>
+
+#include <algorithm>
+#include <memory>
+
+using namespace std;
+
+using google::protobuf::DynamicMessageFactory;
+using google::protobuf::Reflection;
+
+// What one thread has found, merged into the totals at the end.
+struct Replay::Counts
+{
+    size_t messages = 0;
+    size_t failed1 = 0;
+    size_t failed2 = 0;
+    size_t affected = 0;
+    map<pair<Kind, const FieldDescriptor*>, Finding> findings;
+};
+
+class Replay::Worker
+{
+public:
+    Worker(const Descriptor * type1, const Descriptor * type2):
+        d_message1(d_factory1.GetPrototype(type1)->New()),
+        d_message2(d_factory2.GetPrototype(type2)->New()),
+        d_type2(type2)
+    {}
+
+    void decode(const uint8_t * data, size_t size);
+
+    Counts counts;
+
+private:
+    void walk(const Message & message, const Descriptor * type2);
+    void add(Kind kind, const FieldDescriptor * field1, const FieldDescriptor * field2);
+
+    // One per pool, so that the prototypes come from the right version.
+    DynamicMessageFactory d_factory1;
+    DynamicMessageFactory d_factory2;
+    // Reused for every message.
+    unique_ptr<Message> d_message1;
+    unique_ptr<Message> d_message2;
+    const Descriptor * d_type2;
+    // Findings in the current message.
+    vector<Finding> d_found;
+};
+
+// Whether every value of a field of type 'from' is read back the same as
+// type 'to'. Only scalar types qualify; a nested message is walked instead.
+static
+bool widens(google::protobuf::FieldDescriptor::Type from, google::protobuf::FieldDescriptor::Type to)
+{
+    using Field = google::protobuf::FieldDescriptor;
+
+    switch (from)
+    {
+    // Negative int32 values are written sign-extended to 64 bits.
+    case Field::TYPE_INT32:
+        return to == Field::TYPE_INT64;
+    case Field::TYPE_UINT32:
+        return to == Field::TYPE_UINT64 || to == Field::TYPE_INT64;
+    case Field::TYPE_SINT32:
+        return to == Field::TYPE_SINT64;
+    case Field::TYPE_BOOL:
+        return to == Field::TYPE_INT32 || to == Field::TYPE_INT64 ||
+               to == Field::TYPE_UINT32 || to == Field::TYPE_UINT64;
+    // Enum values are written as int32.
+    case Field::TYPE_ENUM:
+        return to == Field::TYPE_INT32 || to == Field::TYPE_INT64;
+    // Bytes need not be valid UTF-8, so only this way round.
+    case Field::TYPE_STRING:
+        return to == Field::TYPE_BYTES;
+    default:
+        return false;
+    }
+}
+
+void Replay::Worker::decode(const uint8_t * data, size_t size)
+{
+    ++counts.messages;
+    d_found.clear();
+
+    d_message1->Clear();
+    d_message2->Clear();
+    // ParseFromArray() would log every message with missing required fields.
+    bool parsed1 = d_message1->ParsePartialFromArray(data, int(size)) && d_message1->IsInitialized();
+    bool parsed2 = d_message2->ParsePartialFromArray(data, int(size)) && d_message2->IsInitialized();
+
+    if (!parsed1)
+        ++counts.failed1;
+    if (!parsed2)
+        ++counts.failed2;
+    if (parsed1)
+        walk(*d_message1, d_type2);
+
+    bool breaking = any_of(d_found.begin(), d_found.end(), [](const Finding & found)
+    {
+        return found.kind != Field_Type_Widened;
+    });
+    if (!parsed1 || !parsed2 || breaking)
+        ++counts.affected;
+
+    // Each finding counts once per message, however often it occurs in it.
+    sort(d_found.begin(), d_found.end(), [](const Finding & a, const Finding & b)
+    {
+        return make_pair(a.kind, a.field1) < make_pair(b.kind, b.field1);
+    });
+    for (size_t i = 0; i < d_found.size(); ++i)
+    {
+        auto & found = d_found[i];
+        if (i > 0 && found.kind == d_found[i - 1].kind && found.field1 == d_found[i - 1].field1)
+            continue;
+
+        auto inserted = counts.findings.insert({ { found.kind, found.field1 }, found });
+        ++inserted.first->second.messages;
+    }
+}
+
+void Replay::Worker::add(Kind kind, const FieldDescriptor * field1, const FieldDescriptor * field2)
+{
+    d_found.push_back({ kind, field1, field2, 0 });
+}
+
+void Replay::Worker::walk(const Message & message, const Descriptor * type2)
+{
+    const Reflection * reflection = message.GetReflection();
+    vector<const FieldDescriptor*> fields;
+    reflection->ListFields(message, &fields);
+
+    for (auto * field1 : fields)
+    {
+        // Extensions are not looked up by number in the message type.
+        if (field1->is_extension())
+            continue;
+
+        auto * field2 = type2->FindFieldByNumber(field1->number());
+        if (!field2)
+        {
+            add(Field_Unknown, field1, nullptr);
+            continue;
+        }
+        if (field1->type() != field2->type())
+        {
+            if (!widens(field1->type(), field2->type()))
+            {
+                add(Field_Type_Changed, field1, field2);
+                continue;
+            }
+            add(Field_Type_Widened, field1, field2);
+        }
+        if (field1->is_repeated() != field2->is_repeated())
+            add(Field_Label_Changed, field1, field2);
+
+        int count = field1->is_repeated() ? reflection->FieldSize(message, field1) : 1;
+
+        if (field1->cpp_type() == FieldDescriptor::CPPTYPE_MESSAGE)
+        {
+            for (int i = 0; i < count; ++i)
+            {
+                const Message & value = field1->is_repeated() ?
+                        reflection->GetRepeatedMessage(message, field1, i) :
+                        reflection->GetMessage(message, field1);
+                walk(value, field2->message_type());
+            }
+        }
+        else if (field1->cpp_type() == FieldDescriptor::CPPTYPE_ENUM && field2->enum_type())
+        {
+            for (int i = 0; i < count; ++i)
+            {
+                int value = field1->is_repeated() ?
+                        reflection->GetRepeatedEnumValue(message, field1, i) :
+                        reflection->GetEnumValue(message, field1);
+                if (!field2->enum_type()->FindValueByNumber(value))
+                {
+                    add(Enum_Value_Unknown, field1, field2);
+                    break;
+                }
+            }
+        }
+    }
+}
+
+Replay::Replay(const Descriptor * type1, const Descriptor * type2, const Options & options):
+    d_type1(type1),
+    d_type2(type2),
+    d_options(options)
+{}
+
+void Replay::run(const string & corpus_path)
+{
+    Corpus corpus(corpus_path, d_options.batch_size);
+
+    unsigned jobs = max(1u, min(d_options.jobs, unsigned(corpus.batches().size())));
+    vector<unique_ptr<Worker>> workers;
+    for (unsigned i = 0; i < jobs; ++i)
+        workers.emplace_back(new Worker(d_type1, d_type2));
+
+    corpus.run(jobs, [&workers](unsigned worker, const Corpus::Batch & batch)
+    {
+        const uint8_t * pos = batch.begin;
+        const uint8_t * data;
+        size_t size;
+        while (Corpus::next(pos, batch.end, data, size))
+            workers[worker]->decode(data, size);
+    });
+
+    for (auto & worker : workers)
+        merge(worker->counts);
+}
+
+void Replay::merge(const Counts & counts)
+{
+    d_messages += counts.messages;
+    d_failed1 += counts.failed1;
+    d_failed2 += counts.failed2;
+    d_affected += counts.affected;
+
+    for (auto & found : counts.findings)
+    {
+        auto inserted = d_findings.insert({ found.first, found.second });
+        if (!inserted.second)
+            inserted.first->second.messages += found.second.messages;
+    }
+}
+
+vector<Replay::Finding> Replay::findings() const
+{
+    vector<Finding> result;
+    for (auto & found : d_findings)
+        result.push_back(found.second);
+
+    stable_sort(result.begin(), result.end(), [](const Finding & a, const Finding & b)
+    {
+        return a.messages > b.messages;
+    });
+    return result;
+}
+
+static
+const char * label_name(const google::protobuf::FieldDescriptor * field)
+{
+    return field->is_repeated() ? "repeated" : "singular";
+}
+
+void Replay::print(OutputBuffer & out) const
+{
+    auto line = [&out](const string & label, size_t count)
+    {
+        out.write(label);
+        out.write(": ");
+        out.write(to_string(count));
+        out.write('\n');
+    };
+
+    line("Messages", d_messages);
+    line("Failed to parse with version 1", d_failed1);
+    line("Failed to parse with version 2", d_failed2);
+    line("Affected", d_affected);
+
+    for (auto & found : findings())
+    {
+        string field = found.field1->full_name() + " (" + to_string(found.field1->number()) + ")";
+        switch (found.kind)
+        {
+        case Field_Unknown:
+            line("* Field unknown: " + field, found.messages);
+            break;
+        case Field_Type_Changed:
+            line("* Field type changed: " + field + " " + found.field1->type_name() + " -> " +
+                 found.field2->type_name(), found.messages);
+            break;
+        case Field_Type_Widened:
+            line("* Field type widened: " + field + " " + found.field1->type_name() + " -> " +
+                 found.field2->type_name(), found.messages);
+            break;
+        case Field_Label_Changed:
+            line("* Field label changed: " + field + " " + label_name(found.field1) + " -> " +
+                 label_name(found.field2), found.messages);
+            break;
+        case Enum_Value_Unknown:
+            line("* Enum value unknown: " + field, found.messages);
+            break;
+        }
+    }
+}
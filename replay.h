@@ -0,0 +1,98 @@
+#pragma once
+
+#include <google/protobuf/descriptor.h>
+
+#include <cstddef>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+class OutputBuffer;
+
+// Decodes a corpus of real messages of one type with both versions of a
+// schema, to see which of the changes the data is actually affected by.
+//
+// The corpus is a file of length-delimited messages, each preceded by its
+// size as a varint, as written by writeDelimitedTo(). It is memory mapped
+// and split into batches of whole messages, which 'jobs' threads take in
+// turn. Each thread has its own DynamicMessageFactory.
+//
+// Every message is parsed with both versions. The fields set in the first
+// version's parse are then looked up by number in the second version: a
+// field that is not there any more becomes unknown, one with another type
+// or label is read differently, and an enum value that is not defined any
+// more is unknown as well. Each of these is counted once per message. A
+// type change that reads every value the same, such as int32 to int64,
+// is counted too, but doesn't make the message affected.
+class Replay
+{
+    using Descriptor = google::protobuf::Descriptor;
+    using FieldDescriptor = google::protobuf::FieldDescriptor;
+    using Message = google::protobuf::Message;
+
+public:
+    struct Options
+    {
+        Options() {}
+        unsigned jobs = 1;
+        // Bytes of messages per batch.
+        size_t batch_size = 4 * 1024 * 1024;
+    };
+
+    enum Kind
+    {
+        Field_Unknown,
+        Field_Type_Changed,
+        // Same wire type, and every value of the first type fits the second.
+        Field_Type_Widened,
+        Field_Label_Changed,
+        Enum_Value_Unknown
+    };
+
+    // A field of the first version, set in at least one message, that the
+    // second version reads differently.
+    struct Finding
+    {
+        Kind kind;
+        const FieldDescriptor * field1;
+        // Null for Field_Unknown.
+        const FieldDescriptor * field2;
+        // Messages it occurs in.
+        size_t messages;
+    };
+
+    Replay(const Descriptor * type1, const Descriptor * type2, const Options & options = Options{});
+
+    // Decodes every message in the file at 'corpus_path'. Throws
+    // std::runtime_error if it cannot be read or is not a valid corpus.
+    void run(const std::string & corpus_path);
+
+    size_t messages() const { return d_messages; }
+    // Messages that failed to parse, including missing required fields.
+    size_t failed1() const { return d_failed1; }
+    size_t failed2() const { return d_failed2; }
+    // Messages with any finding but Field_Type_Widened, or that failed to parse with either version.
+    size_t affected() const { return d_affected; }
+    // Sorted by the number of messages, most first.
+    std::vector<Finding> findings() const;
+
+    // Writes the counts and findings as text.
+    void print(OutputBuffer & out) const;
+
+private:
+    struct Counts;
+    class Worker;
+
+    void merge(const Counts & counts);
+
+    const Descriptor * d_type1;
+    const Descriptor * d_type2;
+    Options d_options;
+
+    size_t d_messages = 0;
+    size_t d_failed1 = 0;
+    size_t d_failed2 = 0;
+    size_t d_affected = 0;
+    std::map<std::pair<Kind, const FieldDescriptor*>, Finding> d_findings;
+};
@@ -0,0 +1,380 @@
+#include "report_writer.h"
+
+#include <cerrno>
+#include <stdexcept>
+
+#ifndef _WIN32
+#include <unistd.h>
+#else
+#include <io.h>
+#endif
+
+using namespace std;
+
+OutputBuffer::OutputBuffer(int fd, size_t capacity):
+    d_fd(fd),
+    d_data(new char[capacity]),
+    d_capacity(capacity)
+{}
+
+OutputBuffer::~OutputBuffer()
+{
+    try
+    {
+        flush();
+    }
+    catch (std::exception &)
+    {
+        // Nowhere left to report it.
+    }
+}
+
+void OutputBuffer::flush()
+{
+    size_t size = d_size;
+    d_size = 0;
+    write_through(string_view(d_data.get(), size));
+}
+
+void OutputBuffer::write_through(string_view text)
+{
+    const char * data = text.data();
+    size_t left = text.size();
+    while (left)
+    {
+#ifndef _WIN32
+        auto written = ::write(d_fd, data, left);
+#else
+        auto written = ::_write(d_fd, data, unsigned(left));
+#endif
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            throw std::runtime_error("Failed to write output.");
+        }
+        data += written;
+        left -= size_t(written);
+    }
+}
+
+// Enough for the depth of any report: root, message or enum, field or value.
+static const string_view indentation = "                                                                ";
+
+void TextWriter::indent()
+{
+    size_t width = size_t(d_level) * 2;
+    while (width > indentation.size())
+    {
+        d_out.write(indentation);
+        width -= indentation.size();
+    }
+    d_out.write(indentation.substr(0, width));
+}
+
+void TextWriter::begin_section(Comparison::SectionType type, string_view a, string_view b)
+{
+    indent();
+
+    auto * label = Comparison::label(type);
+    if (!label)
+    {
+        d_out.write('?');
+    }
+    else
+    {
+        d_out.write(label);
+        if (type != Comparison::Root_Section)
+        {
+            d_out.write(": ");
+            d_out.write(a);
+            d_out.write(" -> ");
+            d_out.write(b);
+        }
+    }
+    d_out.write('\n');
+
+    ++d_level;
+}
+
+void TextWriter::note(string_view a, string_view b)
+{
+    indent();
+    d_out.write("Required by ");
+    d_out.write(a);
+    d_out.write(" -> ");
+    d_out.write(b);
+    d_out.write('\n');
+}
+
+void TextWriter::item(Comparison::ItemType type, string_view a, string_view b)
+{
+    indent();
+    d_out.write("* ");
+
+    auto * label = Comparison::label(type);
+    if (!label)
+    {
+        d_out.write('?');
+    }
+    else
+    {
+        d_out.write(label);
+        d_out.write(": ");
+        d_out.write(a);
+        d_out.write(" -> ");
+        d_out.write(b);
+    }
+    d_out.write('\n');
+}
+
+void TextWriter::end_section()
+{
+    --d_level;
+}
+
+const char * json_name(Comparison::ItemType type)
+{
+    switch (type)
+    {
+    case Comparison::Enum_Value_Name_Changed:
+        return "enum_value_name_changed";
+    case Comparison::Enum_Value_Id_Changed:
+        return "enum_value_id_changed";
+    case Comparison::Enum_Value_Added:
+        return "enum_value_added";
+    case Comparison::Enum_Value_Removed:
+        return "enum_value_removed";
+    case Comparison::Message_Field_Name_Changed:
+        return "message_field_name_changed";
+    case Comparison::Message_Field_Id_Changed:
+        return "message_field_id_changed";
+    case Comparison::Message_Field_Label_Changed:
+        return "message_field_label_changed";
+    case Comparison::Message_Field_Type_Changed:
+        return "message_field_type_changed";
+    case Comparison::Message_Field_Default_Value_Changed:
+        return "message_field_default_value_changed";
+    case Comparison::Message_Field_Added:
+        return "message_field_added";
+    case Comparison::Message_Field_Removed:
+        return "message_field_removed";
+    case Comparison::File_Message_Added:
+        return "file_message_added";
+    case Comparison::File_Message_Removed:
+        return "file_message_removed";
+    case Comparison::File_Enum_Added:
+        return "file_enum_added";
+    case Comparison::File_Enum_Removed:
+        return "file_enum_removed";
+    case Comparison::Name_Missing:
+        return "name_missing";
+    case Comparison::Optional_Message_Field_Added:
+        return "optional_message_field_added";
+    case Comparison::Optional_Message_Field_Removed:
+        return "optional_message_field_removed";
+    case Comparison::File_Service_Added:
+        return "file_service_added";
+    case Comparison::File_Service_Removed:
+        return "file_service_removed";
+    case Comparison::Optional_OutputMessage_Field_Added:
+        return "optional_output_message_field_added";
+    case Comparison::Optional_OutputMessage_Field_Removed:
+        return "optional_output_message_field_removed";
+    case Comparison::Optional_InputMessage_Field_Added:
+        return "optional_input_message_field_added";
+    case Comparison::Optional_InputMessage_Field_Removed:
+        return "optional_input_message_field_removed";
+    case Comparison::File_Added:
+        return "file_added";
+    case Comparison::File_Removed:
+        return "file_removed";
+    default:
+        return "?";
+    }
+}
+
+const char * json_name(Comparison::SectionType type)
+{
+    switch (type)
+    {
+    case Comparison::Root_Section:
+        return "/";
+    case Comparison::Message_Comparison:
+        return "message_comparison";
+    case Comparison::Message_Field_Comparison:
+        return "message_field_comparison";
+    case Comparison::Enum_Comparison:
+        return "enum_comparison";
+    case Comparison::Enum_Value_Comparison:
+        return "enum_value_comparison";
+    case Comparison::File_Comparison:
+        return "file_comparison";
+    case Comparison::Version_Comparison:
+        return "version_comparison";
+    default:
+        return "?";
+    }
+}
+
+static
+void write_json_string(OutputBuffer & out, string_view text)
+{
+    static const char hex[] = "0123456789abcdef";
+
+    out.write('"');
+
+    // Copy runs of plain characters at once; escape the rest.
+    size_t start = 0;
+    for (size_t i = 0; i < text.size(); ++i)
+    {
+        unsigned char c = text[i];
+        if (c >= 0x20 && c != '"' && c != '\\')
+            continue;
+
+        out.write(text.substr(start, i - start));
+        start = i + 1;
+
+        switch (c)
+        {
+        case '"':
+            out.write("\\\"");
+            break;
+        case '\\':
+            out.write("\\\\");
+            break;
+        case '\n':
+            out.write("\\n");
+            break;
+        case '\t':
+            out.write("\\t");
+            break;
+        default:
+            out.write("\\u00");
+            out.write(hex[c >> 4]);
+            out.write(hex[c & 0xf]);
+        }
+    }
+    out.write(text.substr(start));
+
+    out.write('"');
+}
+
+static
+void write_json_item(OutputBuffer & out, Comparison::ItemType type, string_view a, string_view b)
+{
+    out.write("{\"type\":\"");
+    out.write(json_name(type));
+    out.write("\",\"a\":");
+    write_json_string(out, a);
+    out.write(",\"b\":");
+    write_json_string(out, b);
+}
+
+void JsonWriter::enter(Part part)
+{
+    auto & open = d_open.back();
+    if (open == part)
+    {
+        d_out.write(',');
+        return;
+    }
+
+    if (open != No_Part)
+        d_out.write(']');
+
+    switch (part)
+    {
+    case Notes_Part:
+        d_out.write(",\"notes\":[");
+        break;
+    case Items_Part:
+        d_out.write(",\"items\":[");
+        break;
+    default:
+        d_out.write(",\"sections\":[");
+    }
+    open = part;
+}
+
+void JsonWriter::begin_section(Comparison::SectionType type, string_view a, string_view b)
+{
+    if (!d_open.empty())
+        enter(Sections_Part);
+
+    d_out.write("{\"type\":\"");
+    d_out.write(json_name(type));
+    d_out.write('"');
+    if (type != Comparison::Root_Section)
+    {
+        d_out.write(",\"a\":");
+        write_json_string(d_out, a);
+        d_out.write(",\"b\":");
+        write_json_string(d_out, b);
+    }
+
+    d_open.push_back(No_Part);
+}
+
+void JsonWriter::note(string_view a, string_view b)
+{
+    enter(Notes_Part);
+    d_out.write("{\"a\":");
+    write_json_string(d_out, a);
+    d_out.write(",\"b\":");
+    write_json_string(d_out, b);
+    d_out.write('}');
+}
+
+void JsonWriter::item(Comparison::ItemType type, string_view a, string_view b)
+{
+    enter(Items_Part);
+    write_json_item(d_out, type, a, b);
+    d_out.write('}');
+}
+
+void JsonWriter::end_section()
+{
+    if (d_open.back() != No_Part)
+        d_out.write(']');
+    d_out.write('}');
+
+    d_open.pop_back();
+    if (d_open.empty())
+        d_out.write('\n');
+}
+
+void NdjsonWriter::begin_section(Comparison::SectionType type, string_view a, string_view b)
+{
+    d_open.push_back({ type, a, b });
+}
+
+void NdjsonWriter::item(Comparison::ItemType type, string_view a, string_view b)
+{
+    write_json_item(d_out, type, a, b);
+
+    d_out.write(",\"path\":[");
+    bool first = true;
+    for (auto & open : d_open)
+    {
+        if (open.type == Comparison::Root_Section)
+            continue;
+        if (!first)
+            d_out.write(',');
+        first = false;
+
+        d_out.write("{\"type\":\"");
+        d_out.write(json_name(open.type));
+        d_out.write("\",\"a\":");
+        write_json_string(d_out, open.a);
+        d_out.write(",\"b\":");
+        write_json_string(d_out, open.b);
+        d_out.write('}');
+    }
+    d_out.write("]}\n");
+}
+
+void NdjsonWriter::end_section()
+{
+    d_open.pop_back();
+}
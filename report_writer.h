@@ -0,0 +1,131 @@
+#pragma once
+
+#include "comparison.h"
+
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+// Collects output in a large buffer and writes it to a file descriptor
+// only when the buffer is full or on flush(), rather than once per line.
+class OutputBuffer
+{
+public:
+    explicit OutputBuffer(int fd = 1, size_t capacity = 256 * 1024);
+    ~OutputBuffer();
+
+    OutputBuffer(const OutputBuffer &) = delete;
+    OutputBuffer & operator=(const OutputBuffer &) = delete;
+
+    void write(std::string_view text)
+    {
+        if (text.size() > d_capacity - d_size)
+        {
+            flush();
+            if (text.size() > d_capacity)
+            {
+                write_through(text);
+                return;
+            }
+        }
+        std::memcpy(d_data.get() + d_size, text.data(), text.size());
+        d_size += text.size();
+    }
+
+    void write(char c)
+    {
+        if (d_size == d_capacity)
+            flush();
+        d_data[d_size++] = c;
+    }
+
+    // Writes out what is buffered. Throws std::runtime_error if the descriptor cannot be written.
+    void flush();
+
+private:
+    void write_through(std::string_view text);
+
+    int d_fd;
+    std::unique_ptr<char[]> d_data;
+    size_t d_capacity;
+    size_t d_size = 0;
+};
+
+// Writes the report as indented text as the comparison produces it,
+// in the same form as Comparison::Report::print().
+class TextWriter : public Comparison::Sink
+{
+public:
+    explicit TextWriter(OutputBuffer & out): d_out(out) {}
+
+    void begin_section(Comparison::SectionType type, std::string_view a, std::string_view b) override;
+    void note(std::string_view a, std::string_view b) override;
+    void item(Comparison::ItemType type, std::string_view a, std::string_view b) override;
+    void end_section() override;
+
+private:
+    void indent();
+
+    OutputBuffer & d_out;
+    int d_level = 0;
+};
+
+// Writes the report as one JSON document, in the shape of the tests'
+// diff.json files: each section is an object with "type", "a" and "b"
+// (not for the root), then "notes", "items" and "sections" arrays where
+// there are any. Nothing is held beyond the sections currently open.
+class JsonWriter : public Comparison::Sink
+{
+public:
+    explicit JsonWriter(OutputBuffer & out): d_out(out) {}
+
+    void begin_section(Comparison::SectionType type, std::string_view a, std::string_view b) override;
+    void note(std::string_view a, std::string_view b) override;
+    void item(Comparison::ItemType type, std::string_view a, std::string_view b) override;
+    void end_section() override;
+
+private:
+    // The array of the section that is being written.
+    enum Part
+    {
+        No_Part,
+        Notes_Part,
+        Items_Part,
+        Sections_Part
+    };
+
+    void enter(Part part);
+
+    OutputBuffer & d_out;
+    std::vector<Part> d_open;
+};
+
+// Writes one JSON object per item and line, with "type", "a", "b" and a
+// "path" of the sections it is in, outermost first and without the root.
+class NdjsonWriter : public Comparison::Sink
+{
+public:
+    explicit NdjsonWriter(OutputBuffer & out): d_out(out) {}
+
+    void begin_section(Comparison::SectionType type, std::string_view a, std::string_view b) override;
+    void note(std::string_view, std::string_view) override {}
+    void item(Comparison::ItemType type, std::string_view a, std::string_view b) override;
+    void end_section() override;
+
+private:
+    struct Open
+    {
+        Comparison::SectionType type;
+        std::string_view a;
+        std::string_view b;
+    };
+
+    OutputBuffer & d_out;
+    std::vector<Open> d_open;
+};
+
+// The type names used in JSON output, e.g. "message_field_added".
+const char * json_name(Comparison::ItemType type);
+const char * json_name(Comparison::SectionType type);
@@ -0,0 +1,260 @@
+#include "server.h"
+#include "parse_cache.h"
+#include "report_writer.h"
+
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+Server::Server(const string & socket_path, const Options & options):
+    d_socket_path(socket_path),
+    d_options(options)
+{
+    d_options.source.memo = &d_memo;
+    d_options.source.buffer_errors = true;
+}
+
+Server::~Server()
+{
+#ifndef _WIN32
+    if (d_socket >= 0)
+    {
+        close(d_socket);
+        unlink(d_socket_path.c_str());
+    }
+#endif
+}
+
+void Server::run()
+{
+#ifndef _WIN32
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (d_socket_path.size() >= sizeof(address.sun_path))
+        throw std::runtime_error("Socket path too long: " + d_socket_path);
+    strcpy(address.sun_path, d_socket_path.c_str());
+
+    // A socket left behind by an earlier server is replaced.
+    unlink(d_socket_path.c_str());
+
+    d_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (d_socket < 0)
+        throw std::runtime_error("Failed to create socket.");
+    if (bind(d_socket, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+            listen(d_socket, 64) != 0)
+    {
+        throw std::runtime_error("Failed to listen on " + d_socket_path + ": " + strerror(errno));
+    }
+
+    while (true)
+    {
+        int connection = accept(d_socket, nullptr, nullptr);
+        if (connection < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            throw std::runtime_error(string("Failed to accept connection: ") + strerror(errno));
+        }
+
+        thread(&Server::serve, this, connection).detach();
+    }
+#else
+    throw std::runtime_error("Server mode is not supported on this platform.");
+#endif
+}
+
+void Server::serve(int connection)
+{
+#ifndef _WIN32
+    // The request is the first line.
+    string request;
+    char buffer[4096];
+    bool complete = false;
+    while (!complete)
+    {
+        auto received = recv(connection, buffer, sizeof(buffer), 0);
+        if (received < 0 && errno == EINTR)
+            continue;
+        if (received <= 0)
+            break;
+
+        string_view data(buffer, size_t(received));
+        auto end = data.find('\n');
+        complete = end != string_view::npos;
+        request.append(data.substr(0, end));
+    }
+
+    try
+    {
+        OutputBuffer out(connection);
+        handle(request, out);
+        out.flush();
+    }
+    catch (std::exception &)
+    {
+        // The client has gone away.
+    }
+
+    close(connection);
+#else
+    (void) connection;
+#endif
+}
+
+int Server::handle(const string & request, OutputBuffer & out)
+{
+    vector<string> args;
+    istringstream words(request);
+    string word;
+    while (words >> word)
+        args.push_back(word);
+
+    Comparison::Options options;
+    options.jobs = d_options.jobs;
+    string format = "text";
+
+    auto fail = [&out](const string & message)
+    {
+        out.write("1\n");
+        out.write(message);
+        out.write('\n');
+        return 1;
+    };
+
+    if (args.size() < 5)
+        return fail("Expected arguments: root1 file1 root2 file2 type [--binary] [--fail-fast] [--format=<text|json|ndjson>]");
+
+    for (size_t i = 5; i < args.size(); ++i)
+    {
+        auto & arg = args[i];
+        if (arg == "--binary")
+            options.binary = true;
+        else if (arg == "--fail-fast")
+            options.fail_fast = true;
+        else if (arg.compare(0, 9, "--format=") == 0)
+            format = arg.substr(9);
+        else
+            return fail("Unknown option: " + arg);
+    }
+
+    unique_ptr<Comparison::Sink> writer;
+    if (format == "json")
+        writer.reset(new JsonWriter(out));
+    else if (format == "ndjson")
+        writer.reset(new NdjsonWriter(out));
+    else if (format == "text")
+        writer.reset(new TextWriter(out));
+    else
+        return fail("Unknown format: " + format);
+
+    // Held until the report is written, as it refers to names in their pools.
+    shared_ptr<Source> source1, source2;
+    try
+    {
+        source1 = source(args[0], args[1]);
+        source2 = source(args[2], args[3]);
+    }
+    catch (std::exception & e)
+    {
+        return fail(e.what());
+    }
+
+    // Only loading can fail, so the report is streamed after the status.
+    if (!options.fail_fast)
+    {
+        options.sink = writer.get();
+        out.write("0\n");
+    }
+
+    Comparison comparison(options);
+    auto & type_name = args[4];
+    if (type_name == ".")
+        comparison.compare(*source1, *source2);
+    else
+        comparison.compare(*source1, type_name, *source2, type_name);
+
+    if (!options.fail_fast)
+        return 0;
+
+    auto * item = comparison.first_breaking();
+    if (!item)
+    {
+        out.write("0\n");
+        return 0;
+    }
+    out.write("2\nBreaking change: ");
+    out.write(item->message());
+    out.write('\n');
+    return 2;
+}
+
+shared_ptr<Source> Server::source(const string & root, const string & file_path)
+{
+    auto key = make_pair(root, file_path);
+    shared_ptr<Source> cached;
+    {
+        lock_guard<mutex> lock(d_sources_mutex);
+        auto it = d_sources.find(key);
+        if (it != d_sources.end())
+            cached = it->second;
+    }
+
+    // Checked outside the lock, so that requests don't wait on each other's reads.
+    if (cached && unchanged(*cached, root))
+        return cached;
+
+    // The diagnostics of a source that fails to load go to the client.
+    string errors;
+    auto options = d_options.source;
+    options.errors = &errors;
+
+    shared_ptr<Source> loaded;
+    try
+    {
+        loaded = make_shared<Source>(file_path, root, options);
+    }
+    catch (std::exception & e)
+    {
+        {
+            lock_guard<mutex> lock(d_sources_mutex);
+            d_sources.erase(key);
+        }
+        throw std::runtime_error(errors + e.what());
+    }
+    loaded->flush_errors();
+
+    lock_guard<mutex> lock(d_sources_mutex);
+    d_sources[key] = loaded;
+    return loaded;
+}
+
+bool Server::unchanged(const Source & source, const string & root)
+{
+    // Without a memo, e.g. for a descriptor set, nothing tells whether it is unchanged.
+    if (source.file_hashes().empty())
+        return false;
+
+    // Reading every file again is quick next to parsing any of them.
+    auto tree = Source::open_root(root);
+    string contents;
+    for (auto & file : source.file_hashes())
+    {
+        if (!read_source_file(*tree, file.first, &contents) ||
+                ParseCache::hash(contents) != file.second)
+        {
+            return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "comparison.h"
+#include "source.h"
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+
+class OutputBuffer;
+
+// Answers comparison requests on a local Unix domain socket, keeping the
+// sources it has loaded between requests.
+//
+// A client connects, writes one line of whitespace separated arguments,
+// "root1 file1 root2 file2 type [--binary] [--fail-fast] [--format=<f>]",
+// and reads the reply until the server closes the connection: a line with
+// the exit status the command line would have had (0, 1 or 2), then the
+// report or error message.
+//
+// A loaded source is used again as long as none of the files it was parsed
+// from has changed. Otherwise it is loaded anew, and only the files that
+// changed are parsed again. Each connection is served on its own thread;
+// sources are shared between them read-only.
+class Server
+{
+public:
+    struct Options
+    {
+        Options() {}
+        // How sources are loaded. A memo of the server's own is always used.
+        Source::Options source;
+        // Threads per comparison.
+        unsigned jobs = 1;
+    };
+
+    Server(const string & socket_path, const Options & options = Options{});
+    ~Server();
+
+    Server(const Server &) = delete;
+    Server & operator=(const Server &) = delete;
+
+    // Serves connections until the process ends. Throws std::runtime_error if
+    // the socket cannot be set up.
+    void run();
+
+private:
+    void serve(int connection);
+    // Runs the request on one line and writes the reply. Returns the status.
+    int handle(const string & request, OutputBuffer & out);
+    // The source of 'file_path' in 'root', loaded or up to date from before.
+    shared_ptr<Source> source(const string & root, const string & file_path);
+    static bool unchanged(const Source & source, const string & root);
+
+    string d_socket_path;
+    Options d_options;
+    int d_socket = -1;
+
+    ParseMemo d_memo;
+    std::mutex d_sources_mutex;
+    std::map<std::pair<string, string>, shared_ptr<Source>> d_sources;
+};
@@ -0,0 +1,480 @@
+#include "source.h"
+#include "git_source_tree.h"
+#include "mapped_descriptor_database.h"
+#include "parse_cache.h"
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <stdexcept>
+#include <vector>
+
+using namespace std;
+
+using google::protobuf::DescriptorPool;
+using google::protobuf::FileDescriptorProto;
+using google::protobuf::FileDescriptorSet;
+using google::protobuf::Message;
+using google::protobuf::SimpleDescriptorDatabase;
+using google::protobuf::compiler::SourceTree;
+using google::protobuf::compiler::SourceTreeDescriptorDatabase;
+using google::protobuf::io::ZeroCopyInputStream;
+
+bool read_source_file(SourceTree & tree, const string & path, string * contents)
+{
+    unique_ptr<ZeroCopyInputStream> input(tree.Open(path));
+    if (!input)
+        return false;
+
+    contents->clear();
+
+    const void * data;
+    int size;
+    while (input->Next(&data, &size))
+        contents->append(static_cast<const char*>(data), size);
+
+    return true;
+}
+
+static
+bool ends_with(const string & text, const string & suffix)
+{
+    return text.size() >= suffix.size() &&
+            text.compare(text.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+bool Source::is_descriptor_set(const string & path)
+{
+    return ends_with(path, ".pb") ||
+            ends_with(path, ".binpb") ||
+            ends_with(path, ".desc") ||
+            ends_with(path, ".protoset");
+}
+
+Source::Source(const string & file_path, const string & root, const Options & options):
+    error_collector(options.buffer_errors)
+{
+    Trace::Span span(options.trace, "import", file_path, root);
+
+    if (options.descriptor_set || is_descriptor_set(root))
+    {
+        if (options.mapped)
+            load_mapped_descriptor_set(file_path, root);
+        else
+            load_descriptor_set(file_path, root);
+    }
+    else if (options.memo)
+        import_memoized(file_path, root, *options.memo);
+    else
+        import_proto(file_path, root, options.cache_dir);
+
+    if (!d_file_descriptor)
+    {
+        error_collector.flush(options.errors);
+        throw std::runtime_error("Failed to load source.");
+    }
+}
+
+unique_ptr<SourceTree> Source::open_root(const string & root)
+{
+    string repository, revision, directory;
+    if (!std::filesystem::exists(root) &&
+            GitSourceTree::parse_spec(root, &repository, &revision, &directory))
+    {
+        return unique_ptr<SourceTree>(new GitSourceTree(repository, revision, directory));
+    }
+
+    unique_ptr<DiskSourceTree> tree(new DiskSourceTree);
+    tree->MapPath("", root);
+    return tree;
+}
+
+void Source::map_root(const string & root)
+{
+    root_tree = open_root(root);
+}
+
+SourceTree & Source::tree()
+{
+    if (root_tree)
+        return *root_tree;
+    return source_tree;
+}
+
+void Source::import_proto(const string & file_path, const string & root_dir, const string & cache_dir)
+{
+    map_root(root_dir);
+
+    if (!cache_dir.empty())
+    {
+        FileDescriptorSet file_set;
+        if (ParseCache(cache_dir).load(root_dir, file_path, tree(), &file_set))
+        {
+            if (adopt_descriptor_set(file_set, root_dir))
+                build_from_database(file_path, root_dir);
+            if (d_file_descriptor)
+                return;
+
+            // A cache entry that doesn't build is ignored; parse from source instead.
+            own_pool.reset();
+            database.reset();
+            d_pool = nullptr;
+        }
+    }
+
+    importer = std::make_shared<Importer>(&tree(), &error_collector);
+
+    d_pool = importer->pool();
+    d_file_descriptor = importer->Import(file_path);
+
+    if (d_file_descriptor && !cache_dir.empty())
+    {
+        ParseCache(cache_dir).store(root_dir, file_path, tree(), d_file_descriptor);
+    }
+}
+
+void Source::load_descriptor_set(const string & file_path, const string & set_path)
+{
+    ifstream input(set_path, ios::binary);
+    if (!input.is_open())
+    {
+        error_collector.AddError(set_path, -1, 0, "File not found.");
+        return;
+    }
+
+    FileDescriptorSet file_set;
+    if (!file_set.ParseFromIstream(&input))
+    {
+        error_collector.AddError(set_path, -1, 0, "Not a valid FileDescriptorSet.");
+        return;
+    }
+
+    if (adopt_descriptor_set(file_set, set_path))
+        build_from_database(file_path, set_path);
+}
+
+bool Source::adopt_descriptor_set(FileDescriptorSet & file_set, const string & set_path)
+{
+    // The database takes the parsed files over as they are; the pool then
+    // only builds descriptors for the requested file and what it imports.
+    auto * simple_database = new SimpleDescriptorDatabase;
+    database.reset(simple_database);
+
+    auto * files = file_set.mutable_file();
+    while (!files->empty())
+    {
+        FileDescriptorProto * file = files->ReleaseLast();
+        if (!simple_database->AddAndOwn(file))
+        {
+            error_collector.AddError(set_path, -1, 0, "Duplicate file in descriptor set: " + file->name());
+            return false;
+        }
+    }
+    return true;
+}
+
+void Source::load_mapped_descriptor_set(const string & file_path, const string & set_path)
+{
+    auto * mapped_database = new MappedDescriptorDatabase;
+    database.reset(mapped_database);
+
+    string error;
+    if (!mapped_database->open(set_path, &error))
+    {
+        error_collector.AddError(set_path, -1, 0, error);
+        return;
+    }
+
+    build_from_database(file_path, set_path);
+}
+
+void Source::build_from_database(const string & file_path, const string & set_path)
+{
+    own_pool.reset(new DescriptorPool(database.get(), &error_collector));
+
+    d_pool = own_pool.get();
+    d_file_descriptor = d_pool->FindFileByName(file_path);
+    if (!d_file_descriptor)
+    {
+        error_collector.AddError(set_path, -1, 0, "File not in descriptor set: " + file_path);
+    }
+}
+
+namespace {
+
+// Passes the errors of building a descriptor on to two collectors.
+class BothCollectors : public DescriptorPool::ErrorCollector
+{
+public:
+    BothCollectors(DescriptorPool::ErrorCollector & first, DescriptorPool::ErrorCollector & second):
+        first(first), second(second) {}
+
+    void AddError(const string & filename, const string & element_name, const Message * descriptor,
+                  ErrorLocation location, const string & message) override
+    {
+        first.AddError(filename, element_name, descriptor, location, message);
+        second.AddError(filename, element_name, descriptor, location, message);
+    }
+
+    void AddWarning(const string & filename, const string & element_name, const Message * descriptor,
+                    ErrorLocation location, const string & message) override
+    {
+        first.AddWarning(filename, element_name, descriptor, location, message);
+        second.AddWarning(filename, element_name, descriptor, location, message);
+    }
+
+private:
+    DescriptorPool::ErrorCollector & first;
+    DescriptorPool::ErrorCollector & second;
+};
+
+struct ParsedFile
+{
+    // Blob id, when read from git.
+    string id;
+    string contents;
+    shared_ptr<const FileDescriptorProto> proto;
+    bool shared = false;
+};
+
+// Reads and parses 'file_path' and everything it imports from 'tree'.
+// 'order' receives the file names with dependencies before dependents.
+// A file whose bytes equal the same file in 'other' reuses its parse. Files
+// from git with the same blob id are known to be equal without reading them.
+bool parse_closure(const string & file_path, SourceTree & tree, ErrorCollector & errors,
+                   const map<string, ParsedFile> * other,
+                   map<string, ParsedFile> & files, vector<string> & order,
+                   ParseMemo * memo = nullptr, const string & root = string())
+{
+    SourceTreeDescriptorDatabase parser(&tree);
+    parser.RecordErrorsTo(&errors);
+
+    auto * git = dynamic_cast<GitSourceTree*>(&tree);
+
+    vector<pair<string, int>> stack { { file_path, -1 } };
+    while (!stack.empty())
+    {
+        auto & top = stack.back();
+        auto & file = files[top.first];
+
+        if (top.second < 0)
+        {
+            top.second = 0;
+
+            if (git)
+                file.id = git->blob_id(top.first);
+
+            const ParsedFile * same = nullptr;
+            auto it = other ? other->find(top.first) : map<string, ParsedFile>::const_iterator();
+            bool known = other && it != other->end();
+
+            if (known && !file.id.empty() && it->second.id == file.id)
+            {
+                same = &it->second;
+            }
+            else
+            {
+                if (!read_source_file(tree, top.first, &file.contents))
+                {
+                    errors.AddError(top.first, -1, 0, tree.GetLastErrorMessage());
+                    return false;
+                }
+
+                if (known && it->second.contents == file.contents)
+                    same = &it->second;
+            }
+
+            if (same)
+            {
+                file.proto = same->proto;
+                file.shared = true;
+            }
+            else if (auto proto = memo ? memo->find(root, top.first, file.contents) : nullptr)
+            {
+                file.proto = proto;
+            }
+            else
+            {
+                auto parsed = make_shared<FileDescriptorProto>();
+                if (!parser.FindFileByName(top.first, parsed.get()))
+                    return false;
+                file.proto = parsed;
+                if (memo)
+                    memo->store(root, top.first, file.contents, parsed);
+            }
+        }
+
+        if (top.second < file.proto->dependency_size())
+        {
+            const string & dependency = file.proto->dependency(top.second++);
+            if (!files.count(dependency))
+                stack.emplace_back(dependency, -1);
+            continue;
+        }
+
+        order.push_back(top.first);
+        stack.pop_back();
+    }
+
+    return true;
+}
+
+}
+
+void Source::load_shared(const string & file_path1, const string & root_dir1,
+                         const string & file_path2, const string & root_dir2,
+                         const Options & options,
+                         unique_ptr<Source> & source1, unique_ptr<Source> & source2)
+{
+    Trace::Span span(options.trace, "import shared", root_dir1, root_dir2);
+
+    source1.reset(new Source);
+    source2.reset(new Source);
+
+    source1->map_root(root_dir1);
+    source2->map_root(root_dir2);
+
+    map<string, ParsedFile> files1, files2;
+    vector<string> order1, order2;
+
+    if (!parse_closure(file_path1, source1->tree(), source1->error_collector, nullptr, files1, order1) ||
+            !parse_closure(file_path2, source2->tree(), source2->error_collector, &files1, files2, order2))
+    {
+        throw std::runtime_error("Failed to load source.");
+    }
+
+    // A file can only live in the shared pool if everything it imports does too.
+    // 'order2' has dependencies first, so one pass settles this.
+    for (auto & name : order2)
+    {
+        auto & file = files2[name];
+        for (auto & dependency : file.proto->dependency())
+            file.shared = file.shared && files2[dependency].shared;
+        if (file.shared)
+            files1[name].shared = true;
+    }
+
+    // A shared file belongs to both versions, and so do its errors.
+    BothCollectors shared_errors(source1->error_collector, source2->error_collector);
+    auto underlay = make_shared<DescriptorPool>();
+    for (auto & name : order2)
+    {
+        if (files2[name].shared)
+            underlay->BuildFileCollectingErrors(*files2[name].proto, &shared_errors);
+    }
+
+    auto build = [&underlay](Source & source, const string & file_path,
+                             map<string, ParsedFile> & files, const vector<string> & order)
+    {
+        source.shared_pool = underlay;
+        source.own_pool.reset(new DescriptorPool(underlay.get()));
+        for (auto & name : order)
+        {
+            if (!files[name].shared)
+                source.own_pool->BuildFileCollectingErrors(*files[name].proto, &source.error_collector);
+        }
+
+        source.d_pool = source.own_pool.get();
+        source.d_file_descriptor = source.d_pool->FindFileByName(file_path);
+        if (!source.d_file_descriptor)
+        {
+            source.error_collector.flush();
+            throw std::runtime_error("Failed to load source.");
+        }
+    };
+
+    build(*source1, file_path1, files1, order1);
+    build(*source2, file_path2, files2, order2);
+}
+
+// Paths of all .proto files below 'root_dir', relative to it, in sorted order.
+static
+vector<string> list_proto_files(const string & root_dir)
+{
+    namespace fs = std::filesystem;
+
+    std::error_code error;
+    if (!fs::is_directory(root_dir, error))
+        throw std::runtime_error("Not a directory: " + root_dir);
+
+    vector<string> paths;
+    for (fs::recursive_directory_iterator it(root_dir, error), end; !error && it != end; it.increment(error))
+    {
+        if (it->is_regular_file(error) && it->path().extension() == ".proto")
+            paths.push_back(it->path().lexically_relative(root_dir).generic_string());
+    }
+
+    if (error)
+        throw std::runtime_error("Failed to list " + root_dir + ": " + error.message());
+
+    sort(paths.begin(), paths.end());
+    return paths;
+}
+
+unique_ptr<Source> Source::load_directory(const string & root_dir, const Options & options)
+{
+    Trace::Span span(options.trace, "import directory", root_dir);
+
+    auto paths = list_proto_files(root_dir);
+
+    unique_ptr<Source> source(new Source(options));
+    source->source_tree.MapPath("", root_dir);
+    source->importer = std::make_shared<Importer>(&source->source_tree, &source->error_collector);
+    source->d_pool = source->importer->pool();
+
+    // Files imported by others are already in the pool when their turn comes.
+    bool loaded = true;
+    for (auto & path : paths)
+    {
+        if (auto * file = source->importer->Import(path))
+            source->d_files.push_back(file);
+        else
+            loaded = false;
+    }
+
+    if (!loaded)
+    {
+        source->error_collector.flush();
+        throw std::runtime_error("Failed to load source.");
+    }
+
+    return source;
+}
+
+shared_ptr<const FileDescriptorProto> ParseMemo::find(const string & root, const string & path, const string & contents)
+{
+    lock_guard<std::mutex> lock(mutex);
+    auto it = parsed.find({ root, path });
+    if (it == parsed.end() || it->second.contents != contents)
+        return nullptr;
+    return it->second.proto;
+}
+
+void ParseMemo::store(const string & root, const string & path, const string & contents,
+                      shared_ptr<const FileDescriptorProto> proto)
+{
+    lock_guard<std::mutex> lock(mutex);
+    parsed[{ root, path }] = { contents, std::move(proto) };
+}
+
+void Source::import_memoized(const string & file_path, const string & root_dir, ParseMemo & memo)
+{
+    map_root(root_dir);
+
+    map<string, ParsedFile> files;
+    vector<string> order;
+    if (!parse_closure(file_path, tree(), error_collector, nullptr, files, order, &memo, root_dir))
+        return;
+
+    // Building descriptors from parsed files is cheap next to parsing them.
+    own_pool.reset(new DescriptorPool);
+    for (auto & name : order)
+    {
+        own_pool->BuildFileCollectingErrors(*files[name].proto, &error_collector);
+        d_file_hashes[name] = ParseCache::hash(files[name].contents);
+    }
+
+    d_pool = own_pool.get();
+    d_file_descriptor = d_pool->FindFileByName(file_path);
+}
@@ -0,0 +1,236 @@
+#pragma once
+
+#include "fingerprint.h"
+#include "trace.h"
+
+#include <google/protobuf/compiler/importer.h>
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/descriptor_database.h>
+#include <google/protobuf/descriptor.pb.h>
+
+#include <iostream>
+#include <sstream>
+#include <memory>
+#include <mutex>
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+using std::string;
+using std::list;
+using std::shared_ptr;
+using std::unique_ptr;
+
+// Reads the whole of 'path' from 'tree' into 'contents'.
+bool read_source_file(google::protobuf::compiler::SourceTree & tree, const string & path, string * contents);
+
+class ErrorCollector :
+        public google::protobuf::compiler::MultiFileErrorCollector,
+        public google::protobuf::DescriptorPool::ErrorCollector
+{
+    using Message = google::protobuf::Message;
+    using ErrorLocation = google::protobuf::DescriptorPool::ErrorCollector::ErrorLocation;
+
+public:
+    // A buffered collector keeps its messages until flush(), so that
+    // sources loaded on different threads don't interleave their output.
+    explicit ErrorCollector(bool buffered = false): buffered(buffered) {}
+
+    void AddError(const std::string & filename, int line, int column, const std::string & message) override
+    {
+        add("Error: ", filename + "@" + std::to_string(line) + "," + std::to_string(column), message);
+    }
+
+    void AddWarning(const std::string & filename, int line, int column, const std::string & message) override
+    {
+        add("Warning: ", filename + "@" + std::to_string(line) + "," + std::to_string(column), message);
+    }
+
+    // Errors found while building descriptors from an already parsed FileDescriptorProto.
+    void AddError(const std::string & filename, const std::string & element_name,
+                  const Message *, ErrorLocation, const std::string & message) override
+    {
+        add("Error: ", filename + ": " + element_name, message);
+    }
+
+    void AddWarning(const std::string & filename, const std::string & element_name,
+                    const Message *, ErrorLocation, const std::string & message) override
+    {
+        add("Warning: ", filename + ": " + element_name, message);
+    }
+
+    // Writes out the messages kept so far, or appends them to 'output' if it is set.
+    void flush(std::string * output = nullptr)
+    {
+        string text = buffer.str();
+        buffer.str("");
+        if (text.empty())
+            return;
+
+        if (output)
+        {
+            output->append(text);
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(output_mutex());
+        std::cerr << text << std::flush;
+    }
+
+private:
+    void add(const char * kind, const std::string & where, const std::string & message)
+    {
+        if (buffered)
+        {
+            buffer << kind << where << ": " << message << '\n';
+        }
+        else
+        {
+            std::lock_guard<std::mutex> lock(output_mutex());
+            std::cerr << kind << where << ": " << message << std::endl;
+        }
+    }
+
+    static std::mutex & output_mutex()
+    {
+        static std::mutex mutex;
+        return mutex;
+    }
+
+    bool buffered;
+    std::ostringstream buffer;
+};
+
+// Parsed .proto files kept from one load to the next, by root and path.
+// A file is parsed again only when its contents have changed. Safe to
+// share between threads.
+class ParseMemo
+{
+    using FileDescriptorProto = google::protobuf::FileDescriptorProto;
+
+public:
+    // The parse of 'path' under 'root' if it was made from exactly 'contents'.
+    shared_ptr<const FileDescriptorProto> find(const string & root, const string & path, const string & contents);
+    void store(const string & root, const string & path, const string & contents,
+               shared_ptr<const FileDescriptorProto> proto);
+
+private:
+    struct Parsed
+    {
+        string contents;
+        shared_ptr<const FileDescriptorProto> proto;
+    };
+
+    std::mutex mutex;
+    std::map<std::pair<string, string>, Parsed> parsed;
+};
+
+class Source
+{
+    using DiskSourceTree = google::protobuf::compiler::DiskSourceTree;
+    using Importer = google::protobuf::compiler::Importer;
+    using DescriptorDatabase = google::protobuf::DescriptorDatabase;
+    using DescriptorPool = google::protobuf::DescriptorPool;
+    using FileDescriptor = google::protobuf::FileDescriptor;
+
+public:
+    struct Options
+    {
+        Options() {}
+        // Hold diagnostics back until flush_errors().
+        bool buffer_errors = false;
+        // With buffer_errors: where the diagnostics of a source that fails to
+        // load are appended, instead of being written to stderr.
+        string * errors = nullptr;
+        // Treat the root as a serialized FileDescriptorSet even without a known extension.
+        bool descriptor_set = false;
+        // Memory map descriptor sets and decode each file only when it is first needed.
+        bool mapped = false;
+        // Directory of the parse cache for .proto imports. Empty disables the cache.
+        string cache_dir;
+        // Reuse the parse of every imported file whose contents are unchanged since it was stored here.
+        ParseMemo * memo = nullptr;
+        // Records a span for each import, if set.
+        Trace * trace = nullptr;
+    };
+
+    // Whether 'path' names a serialized FileDescriptorSet
+    // (as written by protoc --descriptor_set_out) rather than a directory.
+    static bool is_descriptor_set(const string & path);
+
+    Source() {}
+    // Loads 'file_path' from 'root', which is either a directory of .proto
+    // files, a git spec "<repository>@<revision>:<directory>" (see
+    // GitSourceTree) or a FileDescriptorSet containing the file and its imports.
+    Source(const string & file_path, const string & root, const Options & options = Options{});
+
+    // Loads two versions of a schema from .proto directories. Files that are
+    // byte-identical on both sides, along with everything they import, are
+    // parsed once into a pool that both sources share as an underlay. Each
+    // side's own pool then holds only the files that differ.
+    static void load_shared(const string & file_path1, const string & root_dir1,
+                            const string & file_path2, const string & root_dir2,
+                            const Options & options,
+                            unique_ptr<Source> & source1, unique_ptr<Source> & source2);
+
+    // Imports every .proto file under 'root_dir' into one pool, with paths
+    // relative to 'root_dir' as file names. Throws if any of them fails.
+    static unique_ptr<Source> load_directory(const string & root_dir, const Options & options = Options{});
+
+    // Null for a source from load_directory(), which has files() instead.
+    const FileDescriptor * file_descriptor() const { return d_file_descriptor; }
+    // The files of a source from load_directory(), sorted by name.
+    const std::vector<const FileDescriptor*> & files() const { return d_files; }
+    const DescriptorPool * pool() const { return d_pool; }
+    // ParseCache::hash() of every file the source was parsed from, by path.
+    // Only kept for a source loaded with Options::memo.
+    const std::map<string, uint64_t> & file_hashes() const { return d_file_hashes; }
+
+    // Structural hashes of the types in pool(), computed as they are asked for.
+    Fingerprints & fingerprints() const
+    {
+        std::call_once(d_fingerprints_once, [this]() { d_fingerprints.reset(new Fingerprints); });
+        return *d_fingerprints;
+    }
+
+    // The tree of source files that 'root' names: a directory or a git spec.
+    static unique_ptr<google::protobuf::compiler::SourceTree> open_root(const string & root);
+
+    // Writes out any diagnostics held back by a buffered error collector.
+    // Appends them to 'output' instead if it is set.
+    void flush_errors(string * output = nullptr) { error_collector.flush(output); }
+
+    list<string> * requestMessages;
+    list<string> * responseMessages;
+
+private:
+    explicit Source(const Options & options): error_collector(options.buffer_errors) {}
+
+    // Maps a directory, or a git spec "<repository>@<revision>:<directory>".
+    void map_root(const string & root);
+    google::protobuf::compiler::SourceTree & tree();
+    void import_proto(const string & file_path, const string & root_dir, const string & cache_dir);
+    void import_memoized(const string & file_path, const string & root_dir, ParseMemo & memo);
+    void load_descriptor_set(const string & file_path, const string & set_path);
+    // Returns false, with an error, if a file is in the set twice.
+    bool adopt_descriptor_set(google::protobuf::FileDescriptorSet & file_set, const string & set_path);
+    void load_mapped_descriptor_set(const string & file_path, const string & set_path);
+    void build_from_database(const string & file_path, const string & set_path);
+
+    DiskSourceTree source_tree;
+    // The tree a single root maps to; source_tree holds the files of load_directory().
+    unique_ptr<google::protobuf::compiler::SourceTree> root_tree;
+    ErrorCollector error_collector;
+    shared_ptr<Importer> importer;
+    // Declared first so that it outlives the pool layered on top of it.
+    shared_ptr<const DescriptorPool> shared_pool;
+    unique_ptr<DescriptorDatabase> database;
+    unique_ptr<DescriptorPool> own_pool;
+    const DescriptorPool * d_pool = nullptr;
+    const FileDescriptor * d_file_descriptor = nullptr;
+    std::vector<const FileDescriptor*> d_files;
+    std::map<string, uint64_t> d_file_hashes;
+    mutable unique_ptr<Fingerprints> d_fingerprints;
+    mutable std::once_flag d_fingerprints_once;
+};
@@ -0,0 +1,105 @@
+#include "stats.h"
+
+#include <ostream>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+using namespace std;
+
+Stats::Phase::Phase(Stats * stats, const char * name):
+    d_stats(stats),
+    d_name(name)
+{
+    if (!d_stats)
+        return;
+    d_wall = chrono::steady_clock::now();
+    d_cpu = clock();
+}
+
+Stats::Phase::~Phase()
+{
+    if (!d_stats)
+        return;
+
+    // clock() counts the CPU time of all threads of the process.
+    double wall_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - d_wall).count();
+    double cpu_ms = double(clock() - d_cpu) * 1000.0 / CLOCKS_PER_SEC;
+    d_stats->d_phases.push_back({ d_name, wall_ms, cpu_ms });
+}
+
+uint64_t Stats::peak_rss()
+{
+#ifndef _WIN32
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+#ifdef __APPLE__
+    return uint64_t(usage.ru_maxrss);
+#else
+    // In kilobytes on Linux.
+    return uint64_t(usage.ru_maxrss) * 1024;
+#endif
+#else
+    return 0;
+#endif
+}
+
+const char * Stats::name(Counter counter)
+{
+    switch (counter)
+    {
+    case Messages_Compared:
+        return "messages_compared";
+    case Enums_Compared:
+        return "enums_compared";
+    case Identical_Pairs:
+        return "identical_pairs";
+    case Field_Pairs:
+        return "field_pairs";
+    case Enum_Value_Pairs:
+        return "enum_value_pairs";
+    case Memo_Hits:
+        return "memo_hits";
+    case Memo_Misses:
+        return "memo_misses";
+    case Sections_Created:
+        return "sections_created";
+    case Items_Created:
+        return "items_created";
+    case Sections_Written:
+        return "sections_written";
+    case Items_Written:
+        return "items_written";
+    default:
+        return "?";
+    }
+}
+
+void Stats::write_text(ostream & out) const
+{
+    for (auto & phase : d_phases)
+    {
+        out << "Phase " << phase.name << ": " << phase.wall_ms << " ms wall, "
+            << phase.cpu_ms << " ms CPU\n";
+    }
+    for (int i = 0; i < Counter_Count; ++i)
+        out << name(Counter(i)) << ": " << get(Counter(i)) << '\n';
+    out << "peak_rss_bytes: " << peak_rss() << endl;
+}
+
+void Stats::write_json(ostream & out) const
+{
+    out << "{\"phases\":[";
+    for (size_t i = 0; i < d_phases.size(); ++i)
+    {
+        auto & phase = d_phases[i];
+        out << (i ? "," : "") << "{\"name\":\"" << phase.name << "\",\"wall_ms\":" << phase.wall_ms
+            << ",\"cpu_ms\":" << phase.cpu_ms << "}";
+    }
+    out << "],\"counters\":{";
+    for (int i = 0; i < Counter_Count; ++i)
+        out << (i ? "," : "") << "\"" << name(Counter(i)) << "\":" << get(Counter(i));
+    out << "},\"peak_rss_bytes\":" << peak_rss() << "}" << endl;
+}
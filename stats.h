@@ -0,0 +1,80 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <iosfwd>
+#include <string>
+#include <vector>
+
+// Counters and phase timings of one run, written out with --stats.
+// Counters may be added to from any thread; phases are timed on the main
+// thread. Code that counts takes a Stats pointer and does nothing when it
+// is null.
+class Stats
+{
+public:
+    enum Counter
+    {
+        // Pairs of types whose fields or values were compared.
+        Messages_Compared,
+        Enums_Compared,
+        // Pairs skipped because their fingerprints matched.
+        Identical_Pairs,
+        Field_Pairs,
+        Enum_Value_Pairs,
+        // Lookups of a pair of types in the memo of compared pairs.
+        Memo_Hits,
+        Memo_Misses,
+        Sections_Created,
+        Items_Created,
+        // What reached the output; the other sections had no items below them.
+        Sections_Written,
+        Items_Written,
+        Counter_Count
+    };
+
+    // Times the scope it lives in as a phase, if 'stats' is not null.
+    class Phase
+    {
+    public:
+        Phase(Stats * stats, const char * name);
+        ~Phase();
+
+        Phase(const Phase &) = delete;
+        Phase & operator=(const Phase &) = delete;
+
+    private:
+        Stats * d_stats;
+        const char * d_name;
+        std::chrono::steady_clock::time_point d_wall;
+        std::clock_t d_cpu;
+    };
+
+    void add(Counter counter, uint64_t amount = 1)
+    {
+        d_counters[counter].fetch_add(amount, std::memory_order_relaxed);
+    }
+
+    uint64_t get(Counter counter) const { return d_counters[counter].load(std::memory_order_relaxed); }
+
+    // The largest resident set size of the process so far, in bytes; 0 where unknown.
+    static uint64_t peak_rss();
+
+    void write_text(std::ostream & out) const;
+    void write_json(std::ostream & out) const;
+
+private:
+    struct Timing
+    {
+        const char * name;
+        double wall_ms;
+        double cpu_ms;
+    };
+
+    static const char * name(Counter counter);
+
+    std::atomic<uint64_t> d_counters[Counter_Count] = {};
+    std::vector<Timing> d_phases;
+};
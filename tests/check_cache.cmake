@@ -0,0 +1,48 @@
+# Checks the parse cache (--cache-dir): a second run gives the same report
+# from the cache, and a run after b.proto changed gives the new one. Run
+# with cmake -P and these variables:
+#
+#   TOOL            The protobuf-spec-compare executable.
+#   SOURCE          A test directory with a.proto and b.proto that differ.
+#   WORK            A scratch directory; it is replaced.
+cmake_minimum_required(VERSION 3.10)
+
+file(REMOVE_RECURSE "${WORK}")
+file(MAKE_DIRECTORY "${WORK}/root")
+file(COPY "${SOURCE}/a.proto" "${SOURCE}/b.proto" DESTINATION "${WORK}/root")
+
+function(compare output_variable)
+  execute_process(COMMAND "${TOOL}" root a.proto root b.proto . --cache-dir cache
+                  WORKING_DIRECTORY "${WORK}"
+                  RESULT_VARIABLE status
+                  OUTPUT_VARIABLE output
+                  ERROR_VARIABLE errors)
+  if(NOT status EQUAL 0)
+    message(FATAL_ERROR "Exit status ${status}:\n${output}\n${errors}")
+  endif()
+  set(${output_variable} "${output}" PARENT_SCOPE)
+endfunction()
+
+compare(first)
+file(GLOB cached "${WORK}/cache/*")
+if(NOT cached)
+  message(FATAL_ERROR "Nothing was written to the cache.")
+endif()
+
+compare(second)
+if(NOT second STREQUAL first)
+  message(FATAL_ERROR "The cached run differs:\n${first}\n---\n${second}")
+endif()
+
+# With b.proto the same as a.proto, the cached parse of b.proto is out of date.
+file(READ "${WORK}/root/a.proto" contents)
+file(WRITE "${WORK}/root/b.proto" "${contents}")
+compare(changed)
+if(changed STREQUAL first)
+  message(FATAL_ERROR "The cache was used for a changed file:\n${changed}")
+endif()
+
+# Without differences, only the root section is left.
+if(NOT changed STREQUAL "/\n")
+  message(FATAL_ERROR "Unexpected report after the change:\n${changed}")
+endif()
@@ -0,0 +1,59 @@
+# Runs protobuf-spec-compare for a test added with add_cli_test() and checks
+# how it went. Run with cmake -P and these variables:
+#
+#   TOOL            The protobuf-spec-compare executable.
+#   ARGS            Its arguments, separated by '|'.
+#   STATUS          The exit status expected.
+#   EXPECTED        Optional: a file that stdout has to match, as JSON if it
+#                   ends in .json, as text otherwise.
+#   JSON_FILE       Optional: a file the run has to write, holding a JSON
+#                   object with the member JSON_MEMBER.
+#   JSON_STDERR     Optional: a member of the JSON object stderr has to hold.
+#   ERRORS          Optional: a regular expression stderr has to match.
+cmake_minimum_required(VERSION 3.19)
+
+string(REPLACE "|" ";" args "${ARGS}")
+
+if(JSON_FILE)
+  file(REMOVE "${JSON_FILE}")
+endif()
+
+execute_process(COMMAND "${TOOL}" ${args}
+                RESULT_VARIABLE status
+                OUTPUT_VARIABLE output
+                ERROR_VARIABLE errors)
+
+if(NOT "${status}" STREQUAL "${STATUS}")
+  message(FATAL_ERROR "Exit status ${status}, expected ${STATUS}.\nOutput:\n${output}\nErrors:\n${errors}")
+endif()
+
+if(EXPECTED)
+  file(READ "${EXPECTED}" expected)
+  if(EXPECTED MATCHES "\\.json$")
+    string(JSON equal ERROR_VARIABLE error EQUAL "${output}" "${expected}")
+    if(error OR NOT equal)
+      message(FATAL_ERROR "Output differs from ${EXPECTED}:\n${output}\n${error}")
+    endif()
+  elseif(NOT output STREQUAL expected)
+    message(FATAL_ERROR "Output differs from ${EXPECTED}:\n${output}")
+  endif()
+endif()
+
+if(JSON_FILE)
+  file(READ "${JSON_FILE}" content)
+  string(JSON type ERROR_VARIABLE error TYPE "${content}" "${JSON_MEMBER}")
+  if(error)
+    message(FATAL_ERROR "${JSON_FILE} has no valid '${JSON_MEMBER}': ${error}")
+  endif()
+endif()
+
+if(ERRORS AND NOT errors MATCHES "${ERRORS}")
+  message(FATAL_ERROR "stderr doesn't match '${ERRORS}':\n${errors}")
+endif()
+
+if(JSON_STDERR)
+  string(JSON type ERROR_VARIABLE error TYPE "${errors}" "${JSON_STDERR}")
+  if(error)
+    message(FATAL_ERROR "stderr has no valid '${JSON_STDERR}': ${error}\n${errors}")
+  endif()
+endif()
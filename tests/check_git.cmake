@@ -0,0 +1,68 @@
+# Compares two revisions of a file in a git repository, given by specs
+# "<repository>@<revision>:<directory>", and checks that the report is the
+# one for the same files on disk. Run with cmake -P and these variables:
+#
+#   TOOL            The protobuf-spec-compare executable.
+#   GIT             The git executable.
+#   SOURCE          A test directory with a.proto and b.proto that differ.
+#   WORK            A scratch directory; it is replaced.
+cmake_minimum_required(VERSION 3.10)
+
+file(REMOVE_RECURSE "${WORK}")
+file(MAKE_DIRECTORY "${WORK}/repo/protos")
+
+function(run)
+  execute_process(COMMAND ${ARGN}
+                  WORKING_DIRECTORY "${WORK}/repo"
+                  RESULT_VARIABLE status
+                  OUTPUT_QUIET
+                  ERROR_VARIABLE errors)
+  if(NOT status EQUAL 0)
+    message(FATAL_ERROR "${ARGN} failed with ${status}:\n${errors}")
+  endif()
+endfunction()
+
+function(commit file)
+  file(COPY "${SOURCE}/${file}" DESTINATION "${WORK}/repo/protos")
+  file(RENAME "${WORK}/repo/protos/${file}" "${WORK}/repo/protos/m.proto")
+  run("${GIT}" add protos/m.proto)
+  run("${GIT}" -c user.name=test -c user.email=test@example.com commit -q -m "${file}")
+endfunction()
+
+run("${GIT}" init -q)
+commit(a.proto)
+commit(b.proto)
+
+function(compare output_variable root1 file1 root2 file2)
+  execute_process(COMMAND "${TOOL}" "${root1}" "${file1}" "${root2}" "${file2}" . ${ARGN}
+                  WORKING_DIRECTORY "${WORK}"
+                  TIMEOUT 60
+                  RESULT_VARIABLE status
+                  OUTPUT_VARIABLE output
+                  ERROR_VARIABLE errors)
+  if(NOT status EQUAL 0)
+    message(FATAL_ERROR "Exit status ${status}:\n${output}\n${errors}")
+  endif()
+  set(${output_variable} "${output}" PARENT_SCOPE)
+endfunction()
+
+compare(expected "${SOURCE}" a.proto "${SOURCE}" b.proto)
+compare(revisions repo@HEAD~1:protos m.proto repo@HEAD:protos m.proto)
+if(NOT revisions STREQUAL expected)
+  message(FATAL_ERROR "The report for the revisions differs:\n${revisions}\n---\n${expected}")
+endif()
+
+# Both revisions loaded at once, each with git processes of its own. Repeated,
+# as a git process that inherits the other's pipes only hangs at times.
+foreach(run RANGE 20)
+  compare(parallel repo@HEAD~1:protos m.proto repo@HEAD:protos m.proto --parallel-load)
+  if(NOT parallel STREQUAL expected)
+    message(FATAL_ERROR "The report for the revisions loaded in parallel differs:\n${parallel}\n---\n${expected}")
+  endif()
+endforeach()
+
+# A revision against itself, without a directory part.
+compare(same repo@HEAD: protos/m.proto repo@HEAD: protos/m.proto)
+if(NOT same STREQUAL "/\n")
+  message(FATAL_ERROR "Unexpected report for the same revision:\n${same}")
+endif()
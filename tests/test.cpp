@@ -1,8 +1,21 @@
 #include "../json/json.hpp"
 #include "../comparison.h"
+#include "../git_source_tree.h"
+#include "../server.h"
+#include "../watcher.h"
 
+#include <chrono>
+#include <filesystem>
 #include <iostream>
 #include <fstream>
+#include <thread>
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <cstring>
+#include <unistd.h>
+#endif
 
 using nlohmann::json;
 using namespace std;
@@ -82,14 +95,18 @@ void verify(const Comparison::Item & item, json & expected)
             "Item type " + item_type_string(item.type) + " = " + expected_type);
 
     string expected_a = expected["a"];
-    confirm(item.a == expected_a, "Item side A: '" + item.a + "' = '" + expected_a + "'");
+    confirm(item.a == expected_a, "Item side A: '" + string(item.a) + "' = '" + expected_a + "'");
 
     string expected_b = expected["b"];
-    confirm(item.b == expected_b, "Item side B: '" + item.b + "' = '" + expected_b + "'");
+    confirm(item.b == expected_b, "Item side B: '" + string(item.b) + "' = '" + expected_b + "'");
 }
 
-void verify(const Comparison::Section & section, json & expected)
+void verify(const Comparison::Report & report, Comparison::Index index, json & expected)
 {
+    auto & section = report.section(index);
+    auto items = report.items(index);
+    auto subsections = report.subsections(index);
+
     confirm(expected.is_object(), "JSON is an object.");
 
     string expected_type = expected["type"];
@@ -103,16 +120,16 @@ void verify(const Comparison::Section & section, json & expected)
 
     auto & expected_items = expected["items"];
 
-    confirm(section.items.size() == expected_items.size(),
+    confirm(items.size() == expected_items.size(),
             "Number of items = " + to_string(expected_items.size()));
 
-    if (section.items.size())
+    if (items.size())
     {
         confirm(expected_items.is_array(), "JSON has array of items.");
 
-        auto item_it = section.items.begin();
+        auto item_it = items.begin();
         auto expected_item_it = expected_items.begin();
-        while (item_it != section.items.end())
+        while (item_it != items.end())
         {
             verify(*item_it, *expected_item_it);
             ++item_it;
@@ -122,19 +139,21 @@ void verify(const Comparison::Section & section, json & expected)
 
     auto & expected_subsections = expected["sections"];
 
-    confirm(section.subsections.size() == expected_subsections.size(),
+    confirm(subsections.size() == expected_subsections.size(),
             "Number of subsections = " + to_string(expected_subsections.size()));
 
-    if (section.subsections.size())
+    if (subsections.size())
     {
         confirm(expected_subsections.is_array(), "JSON has array of subsections.");
 
-        auto section_it = section.subsections.begin();
+        // Subsections follow their parent's 'next' links; their indices are
+        // only needed to recurse.
+        Comparison::Index child = section.first_subsection;
         auto expected_section_it = expected_subsections.begin();
-        while (section_it != section.subsections.end())
+        while (child != Comparison::None)
         {
-            verify(*section_it, *expected_section_it);
-            ++section_it;
+            verify(report, child, *expected_section_it);
+            child = report.section(child).next;
             ++expected_section_it;
         }
     }
@@ -142,7 +161,191 @@ void verify(const Comparison::Section & section, json & expected)
 
 void verify(const Comparison & comparison, json & expected)
 {
-    verify(comparison.root, expected);
+    verify(comparison.report, 0, expected);
+}
+
+// run-tests --parse-spec <spec> [<repository> <revision> <directory>]: checks
+// that GitSourceTree splits the spec into these parts, or that it is no spec.
+int verify_spec(int argc, char * argv[])
+{
+    string spec(argv[2]);
+    string repository, revision, directory;
+
+    try
+    {
+        bool parsed = GitSourceTree::parse_spec(spec, &repository, &revision, &directory);
+        confirm(parsed == GitSourceTree::is_spec(spec), "is_spec() agrees with parse_spec()");
+        if (argc == 3)
+        {
+            confirm(!parsed, "'" + spec + "' is no spec");
+        }
+        else
+        {
+            confirm(parsed, "'" + spec + "' is a spec");
+            confirm(repository == argv[3], "Repository: '" + repository + "' = '" + argv[3] + "'");
+            confirm(revision == argv[4], "Revision: '" + revision + "' = '" + argv[4] + "'");
+            confirm(directory == argv[5], "Directory: '" + directory + "' = '" + argv[5] + "'");
+        }
+    }
+    catch (std::exception & e)
+    {
+        cerr << "Failed to verify: " << e.what() << endl;
+        return 1;
+    }
+
+    cerr << "OK." << endl;
+    return 0;
+}
+
+#ifndef _WIN32
+// Sends a request line to the server at 'socket_path' and returns the whole reply.
+// Connecting is retried for a while, as the server may still be starting.
+string request(const string & socket_path, const string & line)
+{
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(address.sun_path))
+        throw std::runtime_error("Socket path too long: " + socket_path);
+    strcpy(address.sun_path, socket_path.c_str());
+
+    int connection = -1;
+    for (int attempt = 0; connection < 0; ++attempt)
+    {
+        connection = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (connection < 0)
+            throw std::runtime_error("Failed to create socket.");
+        if (connect(connection, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0)
+        {
+            close(connection);
+            connection = -1;
+            if (attempt == 100)
+                throw std::runtime_error("Failed to connect to " + socket_path);
+            this_thread::sleep_for(chrono::milliseconds(50));
+        }
+    }
+
+    string message = line + "\n";
+    if (write(connection, message.data(), message.size()) != ssize_t(message.size()))
+    {
+        close(connection);
+        throw std::runtime_error("Failed to send the request.");
+    }
+
+    string reply;
+    char buffer[4096];
+    ssize_t received;
+    while ((received = read(connection, buffer, sizeof(buffer))) > 0)
+        reply.append(buffer, size_t(received));
+    close(connection);
+    return reply;
+}
+
+// run-tests --serve <socket> <test directory> [<broken directory>]: checks
+// that a Server answers a JSON request for the directory's a.proto and
+// b.proto with its diff.json, twice, the second time with the sources it
+// loaded for the first. With a directory whose b.proto doesn't parse, also
+// checks that the error reply holds the parser's message.
+int verify_server(const string & socket_path, const string & test_path, const string & broken_path)
+{
+    try
+    {
+        json expected;
+        ifstream diff_file(test_path + "/diff.json");
+        confirm(diff_file.is_open(), "Opened " + test_path + "/diff.json");
+        diff_file >> expected;
+
+        // Serves until the process ends.
+        auto * server = new Server(socket_path);
+        thread([server]()
+        {
+            try
+            {
+                server->run();
+            }
+            catch (std::exception & e)
+            {
+                cerr << "Server failed: " << e.what() << endl;
+                exit(1);
+            }
+        }).detach();
+
+        string line = test_path + " a.proto " + test_path + " b.proto . --format=json";
+        for (int i = 0; i < 2; ++i)
+        {
+            string reply = request(socket_path, line);
+            auto end = reply.find('\n');
+            confirm(end != string::npos && reply.substr(0, end) == "0", "Reply status 0");
+            confirm(json::parse(reply.substr(end + 1)) == expected, "Report = diff.json");
+        }
+
+        if (!broken_path.empty())
+        {
+            string reply = request(socket_path, broken_path + " a.proto " + broken_path + " b.proto .");
+            confirm(reply.compare(0, 2, "1\n") == 0, "Reply status 1");
+            confirm(reply.find("Error: b.proto@") != string::npos, "Reply names the error in b.proto: " + reply);
+        }
+    }
+    catch (std::exception & e)
+    {
+        cerr << "Failed to verify: " << e.what() << endl;
+        return 1;
+    }
+
+    cerr << "OK." << endl;
+    return 0;
+}
+#endif
+
+// run-tests --watch <scratch directory>: checks the files DirectoryWatcher
+// reports as changed, also below directories created while it watches. The
+// changes are all made before waiting, so no timing is involved.
+int verify_watcher(const string & root)
+{
+    namespace fs = std::filesystem;
+
+    auto touch = [&root](const string & path)
+    {
+        ofstream(root + "/" + path) << "syntax = \"proto2\";" << endl;
+    };
+    auto join = [](const vector<string> & paths)
+    {
+        string joined;
+        for (auto & path : paths)
+            joined += (joined.empty() ? "" : " ") + path;
+        return joined;
+    };
+
+    try
+    {
+        fs::remove_all(root);
+        fs::create_directories(root + "/sub");
+
+        DirectoryWatcher watcher(root);
+
+        touch("b.proto");
+        touch("sub/c.proto");
+        touch("a.proto");
+        string changed = join(watcher.wait());
+        confirm(changed == "a.proto b.proto sub/c.proto", "Changed: '" + changed + "' = 'a.proto b.proto sub/c.proto'");
+
+        fs::create_directory(root + "/new");
+        touch("d.proto");
+        changed = join(watcher.wait());
+        confirm(changed == "d.proto", "Changed: '" + changed + "' = 'd.proto'");
+
+        touch("new/e.proto");
+        fs::remove(root + "/a.proto");
+        changed = join(watcher.wait());
+        confirm(changed == "a.proto new/e.proto", "Changed: '" + changed + "' = 'a.proto new/e.proto'");
+    }
+    catch (std::exception & e)
+    {
+        cerr << "Failed to verify: " << e.what() << endl;
+        return 1;
+    }
+
+    cerr << "OK." << endl;
+    return 0;
 }
 
 int main(int argc, char * argv[])
@@ -153,6 +356,38 @@ int main(int argc, char * argv[])
         return 1;
     }
 
+    if (string(argv[1]) == "--parse-spec")
+    {
+        if (argc != 3 && argc != 6)
+        {
+            cerr << "Expected arguments: --parse-spec <spec> [<repository> <revision> <directory>]" << endl;
+            return 1;
+        }
+        return verify_spec(argc, argv);
+    }
+
+    if (string(argv[1]) == "--watch")
+    {
+        if (argc != 3)
+        {
+            cerr << "Expected arguments: --watch <scratch directory>" << endl;
+            return 1;
+        }
+        return verify_watcher(argv[2]);
+    }
+
+#ifndef _WIN32
+    if (string(argv[1]) == "--serve")
+    {
+        if (argc != 4 && argc != 5)
+        {
+            cerr << "Expected arguments: --serve <socket> <test directory> [<broken directory>]" << endl;
+            return 1;
+        }
+        return verify_server(argv[2], argv[3], argc == 5 ? argv[4] : "");
+    }
+#endif
+
     string test_path(argv[1]);
 
     Comparison::Options options;
@@ -166,6 +401,10 @@ int main(int argc, char * argv[])
             {
                 options.binary = true;
             }
+            else if (arg == "--jobs" && i + 1 < argc)
+            {
+                options.jobs = unsigned(stoi(argv[++i]));
+            }
             else
             {
                 cerr << "Unknown option: " << arg << endl;
@@ -175,12 +414,15 @@ int main(int argc, char * argv[])
     }
 
     Comparison comparison(options);
+    // Kept until verified, since the report refers to their descriptors.
+    unique_ptr<Source> source_a;
+    unique_ptr<Source> source_b;
 
     try
     {
-        Source source_a("a.proto", test_path);
-        Source source_b("b.proto", test_path);
-        comparison.compare(source_a, source_b);
+        source_a.reset(new Source("a.proto", test_path));
+        source_b.reset(new Source("b.proto", test_path));
+        comparison.compare(*source_a, *source_b);
     }
     catch (std::exception & e)
     {
@@ -188,9 +430,7 @@ int main(int argc, char * argv[])
         return 1;
     }
 
-    comparison.root.trim();
-
-    comparison.root.print();
+    comparison.report.print();
 
     json expected;
 
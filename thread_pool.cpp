@@ -0,0 +1,156 @@
+#include "thread_pool.h"
+
+using namespace std;
+
+// The queue owned by the current thread, for tasks pushed from within tasks.
+static thread_local const WorkStealingPool * current_pool = nullptr;
+static thread_local unsigned current_queue = 0;
+
+WorkStealingPool::WorkStealingPool(unsigned jobs)
+{
+    if (jobs < 1)
+        jobs = 1;
+
+    for (unsigned i = 0; i < jobs; ++i)
+        queues.emplace_back(new Queue);
+
+    // The last queue belongs to whichever thread calls wait().
+    for (unsigned i = 0; i + 1 < jobs; ++i)
+        threads.emplace_back(&WorkStealingPool::work, this, i);
+}
+
+WorkStealingPool::~WorkStealingPool()
+{
+    {
+        lock_guard<mutex> lock(state_mutex);
+        stopping = true;
+    }
+    state_changed.notify_all();
+
+    for (auto & thread : threads)
+        thread.join();
+}
+
+void WorkStealingPool::push(Task task)
+{
+    unsigned index;
+    if (current_pool == this)
+        index = current_queue;
+    else
+        index = next_queue++ % queues.size();
+
+    ++pending;
+    {
+        lock_guard<mutex> lock(queues[index]->mutex);
+        queues[index]->tasks.push_back(std::move(task));
+    }
+    ++queued;
+
+    {
+        // Taking the lock orders this with a thread checking for work before sleeping.
+        lock_guard<mutex> lock(state_mutex);
+    }
+    state_changed.notify_all();
+}
+
+bool WorkStealingPool::take(unsigned index, Task & task)
+{
+    {
+        auto & own = *queues[index];
+        lock_guard<mutex> lock(own.mutex);
+        if (!own.tasks.empty())
+        {
+            task = std::move(own.tasks.back());
+            own.tasks.pop_back();
+            --queued;
+            return true;
+        }
+    }
+
+    for (size_t offset = 1; offset < queues.size(); ++offset)
+    {
+        auto & other = *queues[(index + offset) % queues.size()];
+        lock_guard<mutex> lock(other.mutex);
+        if (!other.tasks.empty())
+        {
+            task = std::move(other.tasks.front());
+            other.tasks.pop_front();
+            --queued;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool WorkStealingPool::run_one(unsigned index)
+{
+    Task task;
+    if (!take(index, task))
+        return false;
+
+    try
+    {
+        task();
+    }
+    catch (...)
+    {
+        lock_guard<mutex> lock(state_mutex);
+        if (!failure)
+            failure = current_exception();
+    }
+
+    if (--pending == 0)
+    {
+        lock_guard<mutex> lock(state_mutex);
+        state_changed.notify_all();
+    }
+
+    return true;
+}
+
+void WorkStealingPool::work(unsigned index)
+{
+    current_pool = this;
+    current_queue = index;
+
+    while (true)
+    {
+        if (run_one(index))
+            continue;
+
+        unique_lock<mutex> lock(state_mutex);
+        state_changed.wait(lock, [this] { return stopping || queued > 0; });
+        if (stopping)
+            return;
+    }
+}
+
+void WorkStealingPool::wait()
+{
+    auto * outer_pool = current_pool;
+    auto outer_queue = current_queue;
+    current_pool = this;
+    current_queue = unsigned(queues.size() - 1);
+
+    while (pending > 0)
+    {
+        if (run_one(current_queue))
+            continue;
+
+        // Other workers are still running tasks that may push more.
+        unique_lock<mutex> lock(state_mutex);
+        state_changed.wait(lock, [this] { return pending == 0 || queued > 0; });
+    }
+
+    current_pool = outer_pool;
+    current_queue = outer_queue;
+
+    exception_ptr error;
+    {
+        lock_guard<mutex> lock(state_mutex);
+        swap(error, failure);
+    }
+    if (error)
+        rethrow_exception(error);
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed set of threads, each with its own deque of tasks.
+//
+// A task pushed from inside a running task goes onto its own worker's
+// deque, which that worker runs newest first, so related work stays on one
+// thread. Idle workers steal the oldest task from another worker's deque.
+// The thread that calls wait() also works through tasks until none are
+// left, so a pool created with one job runs everything on the caller's
+// thread.
+class WorkStealingPool
+{
+public:
+    using Task = std::function<void()>;
+
+    // 'jobs' counts the calling thread, so jobs - 1 threads are started.
+    explicit WorkStealingPool(unsigned jobs);
+    ~WorkStealingPool();
+
+    WorkStealingPool(const WorkStealingPool &) = delete;
+    WorkStealingPool & operator=(const WorkStealingPool &) = delete;
+
+    void push(Task task);
+
+    // Runs tasks until all tasks pushed so far, and the tasks they push,
+    // are done. Rethrows the first exception a task threw, if any.
+    void wait();
+
+    unsigned jobs() const { return unsigned(queues.size()); }
+
+private:
+    struct Queue
+    {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    void work(unsigned index);
+    bool run_one(unsigned index);
+    bool take(unsigned index, Task & task);
+
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> threads;
+
+    std::mutex state_mutex;
+    std::condition_variable state_changed;
+    // Tasks pushed and not yet finished.
+    std::atomic<size_t> pending { 0 };
+    // Tasks waiting in a deque.
+    std::atomic<size_t> queued { 0 };
+    std::atomic<unsigned> next_queue { 0 };
+    bool stopping = false;
+    std::exception_ptr failure;
+};
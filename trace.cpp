@@ -0,0 +1,153 @@
+#include "trace.h"
+
+#include <ostream>
+
+using namespace std;
+
+static atomic<uint64_t> next_trace_id { 1 };
+
+Trace::Trace(size_t capacity):
+    d_id(next_trace_id++),
+    d_capacity(capacity ? capacity : 1),
+    d_start(chrono::steady_clock::now())
+{}
+
+Trace::Span::Span(Trace * trace, const char * name, string_view a, string_view b):
+    d_trace(trace),
+    d_name(name),
+    d_a(a),
+    d_b(b),
+    d_begin(trace ? trace->now() : 0),
+    d_memo(Memo_None)
+{}
+
+Trace::Span::~Span()
+{
+    if (d_trace)
+        d_trace->record(d_name, 'X', d_memo, d_identical, d_begin, d_trace->now() - d_begin, d_a, d_b);
+}
+
+void Trace::instant(const char * name, string_view a, string_view b, bool memo_hit)
+{
+    record(name, 'i', memo_hit ? Memo_Hit : Memo_Miss, false, now(), 0, a, b);
+}
+
+Trace::Buffer & Trace::buffer()
+{
+    thread_local uint64_t owner = 0;
+    thread_local Buffer * cached = nullptr;
+    if (owner == d_id)
+        return *cached;
+
+    lock_guard<mutex> lock(d_buffers_mutex);
+    d_buffers.emplace_back(new Buffer(d_capacity, unsigned(d_buffers.size() + 1)));
+    owner = d_id;
+    cached = d_buffers.back().get();
+    return *cached;
+}
+
+void Trace::record(const char * name, char phase, char memo, bool identical, int64_t begin, int64_t duration,
+                   string_view a, string_view b)
+{
+    auto & buffer = this->buffer();
+    auto & event = buffer.events[buffer.recorded++ % buffer.events.size()];
+    event.name = name;
+    event.phase = phase;
+    event.memo = memo;
+    event.identical = identical;
+    event.begin = begin;
+    event.duration = duration;
+    // Assigning into the strings of an overwritten event reuses their storage.
+    event.a.assign(a.data(), a.size());
+    event.b.assign(b.data(), b.size());
+}
+
+static
+void write_string(ostream & out, string_view text)
+{
+    static const char hex[] = "0123456789abcdef";
+
+    out << '"';
+    for (unsigned char c : text)
+    {
+        if (c == '"' || c == '\\')
+            out << '\\' << c;
+        else if (c < 0x20)
+            out << "\\u00" << hex[c >> 4] << hex[c & 0xf];
+        else
+            out << c;
+    }
+    out << '"';
+}
+
+// Trace event timestamps are in microseconds.
+static
+void write_microseconds(ostream & out, int64_t nanoseconds)
+{
+    out << nanoseconds / 1000 << '.';
+    auto fraction = to_string(nanoseconds % 1000);
+    out << string(3 - fraction.size(), '0') << fraction;
+}
+
+void Trace::write(ostream & out) const
+{
+    lock_guard<mutex> lock(d_buffers_mutex);
+
+    out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    bool first = true;
+    for (auto & buffer : d_buffers)
+    {
+        out << (first ? "" : ",") << "\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << buffer->thread
+            << ",\"args\":{\"name\":\"thread " << buffer->thread << "\"}}";
+        first = false;
+
+        size_t size = buffer->events.size();
+        uint64_t begin = buffer->recorded > size ? buffer->recorded - size : 0;
+        for (uint64_t i = begin; i < buffer->recorded; ++i)
+        {
+            auto & event = buffer->events[i % size];
+            out << ",\n{\"name\":\"" << event.name << "\",\"ph\":\"" << event.phase << "\",\"pid\":1,\"tid\":"
+                << buffer->thread << ",\"ts\":";
+            write_microseconds(out, event.begin);
+            if (event.phase == 'X')
+            {
+                out << ",\"dur\":";
+                write_microseconds(out, event.duration);
+            }
+            else
+            {
+                out << ",\"s\":\"t\"";
+            }
+
+            out << ",\"args\":{";
+            const char * separator = "";
+            if (!event.a.empty())
+            {
+                out << "\"a\":";
+                write_string(out, event.a);
+                separator = ",";
+            }
+            if (!event.b.empty())
+            {
+                out << separator << "\"b\":";
+                write_string(out, event.b);
+                separator = ",";
+            }
+            if (event.memo != Memo_None)
+            {
+                out << separator << "\"memo\":\"" << (event.memo == Memo_Hit ? "hit" : "miss") << "\"";
+                separator = ",";
+            }
+            if (event.identical)
+                out << separator << "\"identical\":true";
+            out << "}}";
+        }
+
+        if (begin)
+        {
+            out << ",\n{\"name\":\"dropped\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":" << buffer->thread
+                << ",\"ts\":0,\"args\":{\"events\":" << begin << "}}";
+        }
+    }
+    out << "\n]}" << endl;
+}
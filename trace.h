@@ -0,0 +1,113 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Records spans of work as Chrome trace events, to be written out with
+// --trace and opened in chrome://tracing or Perfetto. Each thread records
+// into a ring buffer of its own, so recording takes no lock; once a buffer
+// is full, its oldest events are overwritten. Code that traces takes a
+// Trace pointer and does nothing when it is null.
+class Trace
+{
+public:
+    // 'capacity' is the number of events kept per thread.
+    explicit Trace(size_t capacity = 64 * 1024);
+
+    Trace(const Trace &) = delete;
+    Trace & operator=(const Trace &) = delete;
+
+    // Records the scope it lives in as a span named 'name', with the
+    // arguments "a" and "b" (left out when empty) and "memo" when set.
+    // 'a' and 'b' have to outlive the span.
+    class Span
+    {
+    public:
+        Span(Trace * trace, const char * name, std::string_view a = {}, std::string_view b = {});
+        ~Span();
+
+        Span(const Span &) = delete;
+        Span & operator=(const Span &) = delete;
+
+        // Whether the pair was found in the memo of compared pairs.
+        void memo(bool hit) { d_memo = hit ? Memo_Hit : Memo_Miss; }
+        // Adds "identical": true, for a pair skipped by its fingerprints.
+        void identical() { d_identical = true; }
+
+    private:
+        Trace * d_trace;
+        const char * d_name;
+        std::string_view d_a;
+        std::string_view d_b;
+        int64_t d_begin;
+        char d_memo;
+        bool d_identical = false;
+    };
+
+    // Records an event without duration, as for a lookup that found a pair in the memo.
+    void instant(const char * name, std::string_view a, std::string_view b, bool memo_hit);
+
+    // Writes the events of all threads as a JSON trace, oldest first per thread.
+    // No thread may be recording meanwhile.
+    void write(std::ostream & out) const;
+
+private:
+    enum Memo : char
+    {
+        Memo_None,
+        Memo_Hit,
+        Memo_Miss
+    };
+
+    struct Event
+    {
+        const char * name;
+        // 'X' for a span, 'i' for an instant event.
+        char phase;
+        char memo;
+        bool identical;
+        // Nanoseconds since the trace started.
+        int64_t begin;
+        int64_t duration;
+        // Copied, so that events can outlive the descriptor pools they name.
+        std::string a;
+        std::string b;
+    };
+
+    struct Buffer
+    {
+        Buffer(size_t capacity, unsigned thread): events(capacity), thread(thread) {}
+
+        std::vector<Event> events;
+        // Events recorded so far; the next one goes to events[recorded % events.size()].
+        uint64_t recorded = 0;
+        unsigned thread;
+    };
+
+    int64_t now() const
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now() - d_start).count();
+    }
+
+    // The calling thread's buffer, created on its first event.
+    Buffer & buffer();
+    void record(const char * name, char phase, char memo, bool identical, int64_t begin, int64_t duration,
+                std::string_view a, std::string_view b);
+
+    // Tells traces apart in the threads' cached buffer pointers, even at the same address.
+    const uint64_t d_id;
+    const size_t d_capacity;
+    const std::chrono::steady_clock::time_point d_start;
+
+    mutable std::mutex d_buffers_mutex;
+    std::vector<std::unique_ptr<Buffer>> d_buffers;
+};
@@ -0,0 +1,145 @@
+#include "watcher.h"
+
+#include <algorithm>
+#include <filesystem>
+#include <stdexcept>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <cerrno>
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+#ifdef __linux__
+
+static const uint32_t watched_events =
+        IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF;
+
+DirectoryWatcher::DirectoryWatcher(const string & root):
+    d_root(root)
+{
+    d_fd = inotify_init1(IN_CLOEXEC);
+    if (d_fd < 0)
+        throw std::runtime_error("Failed to watch " + root + ".");
+    add("");
+}
+
+DirectoryWatcher::~DirectoryWatcher()
+{
+    close(d_fd);
+}
+
+void DirectoryWatcher::add(const string & directory)
+{
+    namespace fs = std::filesystem;
+
+    fs::path path = directory.empty() ? fs::path(d_root) : fs::path(d_root) / directory;
+    int wd = inotify_add_watch(d_fd, path.c_str(), watched_events);
+    if (wd < 0)
+    {
+        if (directory.empty())
+            throw std::runtime_error("Failed to watch " + d_root + ".");
+        // Removed again before it could be watched.
+        return;
+    }
+    d_directories[wd] = directory;
+
+    std::error_code error;
+    for (fs::directory_iterator it(path, error), end; !error && it != end; it.increment(error))
+    {
+        if (it->is_directory(error))
+            add(directory.empty() ? it->path().filename().string() : directory + "/" + it->path().filename().string());
+    }
+}
+
+bool DirectoryWatcher::read_events(int timeout_ms, vector<string> & changed)
+{
+    pollfd ready = { d_fd, POLLIN, 0 };
+    int result = poll(&ready, 1, timeout_ms);
+    if (result < 0 && errno == EINTR)
+        return true;
+    if (result < 0)
+        throw std::runtime_error("Failed to watch " + d_root + ".");
+    if (result == 0)
+        return false;
+
+    alignas(inotify_event) char buffer[64 * 1024];
+    auto size = read(d_fd, buffer, sizeof(buffer));
+    if (size < 0)
+    {
+        if (errno == EINTR || errno == EAGAIN)
+            return true;
+        throw std::runtime_error("Failed to watch " + d_root + ".");
+    }
+
+    for (char * data = buffer; data < buffer + size; )
+    {
+        auto * event = reinterpret_cast<inotify_event*>(data);
+        data += sizeof(inotify_event) + event->len;
+
+        auto it = d_directories.find(event->wd);
+        if (it == d_directories.end())
+            continue;
+
+        if (event->mask & IN_IGNORED)
+        {
+            d_directories.erase(it);
+            continue;
+        }
+        if (!event->len)
+            continue;
+
+        string path = it->second.empty() ? string(event->name) : it->second + "/" + event->name;
+        if (event->mask & IN_ISDIR)
+        {
+            // Files in it are seen from now on.
+            if (event->mask & (IN_CREATE | IN_MOVED_TO))
+                add(path);
+            continue;
+        }
+        changed.push_back(path);
+    }
+    return true;
+}
+
+vector<string> DirectoryWatcher::wait(int quiet_ms)
+{
+    vector<string> changed;
+    while (changed.empty())
+        read_events(-1, changed);
+    while (read_events(quiet_ms, changed))
+        ;
+
+    sort(changed.begin(), changed.end());
+    changed.erase(unique(changed.begin(), changed.end()), changed.end());
+    return changed;
+}
+
+#else
+
+DirectoryWatcher::DirectoryWatcher(const string & root):
+    d_root(root)
+{
+    throw std::runtime_error("Watching is not supported on this platform.");
+}
+
+DirectoryWatcher::~DirectoryWatcher()
+{}
+
+vector<string> DirectoryWatcher::wait(int)
+{
+    return vector<string>();
+}
+
+void DirectoryWatcher::add(const string &)
+{}
+
+bool DirectoryWatcher::read_events(int, vector<string> &)
+{
+    return false;
+}
+
+#endif
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+
+// Reports which files below a directory are written, created, moved or
+// removed, using inotify. Directories created later are watched as well.
+class DirectoryWatcher
+{
+public:
+    // Throws std::runtime_error if the directory cannot be watched.
+    explicit DirectoryWatcher(const std::string & root);
+    ~DirectoryWatcher();
+
+    DirectoryWatcher(const DirectoryWatcher &) = delete;
+    DirectoryWatcher & operator=(const DirectoryWatcher &) = delete;
+
+    // Waits for changes, then for 'quiet_ms' without any more of them, so
+    // that an editor's save comes back as one batch. Returns the paths of
+    // the changed files relative to the root, sorted and without duplicates.
+    std::vector<std::string> wait(int quiet_ms = 50);
+
+private:
+    // Watches 'directory' (relative to the root) and everything below it.
+    void add(const std::string & directory);
+    // Reads the events that are ready. Returns false if none came within 'timeout_ms' (-1 waits).
+    bool read_events(int timeout_ms, std::vector<std::string> & changed);
+
+    std::string d_root;
+    int d_fd = -1;
+    // Relative directory of each watch descriptor.
+    std::map<int, std::string> d_directories;
+};